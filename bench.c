@@ -0,0 +1,269 @@
+/* gifdec benchmark -- decoding throughput over a set of GIF files
+ * compiling:
+ *   cc -O2 -o bench gifdec.c bench.c
+ *   cc -O2 -DGD_THREADS -pthread -o bench gifdec.c bench.c
+ * executing:
+ *   ./bench [-j] [-r runs] [-t threads] file.gif...
+ * */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "gifdec.h"
+
+typedef struct Result {
+    const char *fname;
+    long long bytes;
+    uint64_t hash; /* of the file, to tell corpora apart */
+    int frames; /* per run */
+    int error;
+    double seconds; /* all runs, opening included */
+    double *lat; /* per-frame latencies, in seconds */
+    int nlat, lat_size;
+} Result;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+add_latency(Result *res, double t)
+{
+    double *lat;
+    int size;
+
+    if (res->nlat == res->lat_size) {
+        size = res->lat_size ? res->lat_size * 2 : 256;
+        lat = realloc(res->lat, size * sizeof(*lat));
+        if (!lat)
+            return -1;
+        res->lat = lat;
+        res->lat_size = size;
+    }
+    res->lat[res->nlat++] = t;
+    return 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Return the p-th percentile of the sorted latencies, in milliseconds. */
+static double
+percentile(const Result *res, double p)
+{
+    int i;
+
+    if (!res->nlat)
+        return 0;
+    i = (int) (p / 100 * (res->nlat - 1) + 0.5);
+    return res->lat[i] * 1e3;
+}
+
+/* Store the size and FNV-1a hash of fname in res. */
+static void
+hash_file(Result *res)
+{
+    uint8_t buf[0x10000];
+    uint64_t h = 0xCBF29CE484222325;
+    size_t i, n;
+    FILE *f;
+
+    f = fopen(res->fname, "rb");
+    if (!f)
+        return;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (i = 0; i < n; i++)
+            h = (h ^ buf[i]) * 0x100000001B3;
+        res->bytes += n;
+    }
+    fclose(f);
+    res->hash = h;
+}
+
+/* Decode and render every frame of fname, runs times over. */
+static void
+bench_file(Result *res, int runs, int threads)
+{
+    gd_GIF *gif;
+    uint8_t *buf;
+    double t0, t1;
+    int run, ret, error;
+
+    hash_file(res);
+    for (run = 0; run < runs; run++) {
+        t0 = now();
+        gif = gd_open_gif_ex(res->fname, &error);
+        if (!gif) {
+            res->error = error;
+            return;
+        }
+        gd_set_decode_threads(gif, threads);
+        buf = malloc(gif->width * gif->height * 3);
+        if (!buf) {
+            gd_close_gif(gif);
+            res->error = GD_ERR_NOMEM;
+            return;
+        }
+        res->frames = 0;
+        while (1) {
+            t1 = now();
+            ret = gd_get_frame(gif);
+            if (ret != 1)
+                break;
+            gd_render_frame(gif, buf);
+            if (add_latency(res, now() - t1) == -1) {
+                ret = -1;
+                gif->error = GD_ERR_NOMEM;
+                break;
+            }
+            res->frames++;
+        }
+        if (ret == -1)
+            res->error = gif->error;
+        gd_close_gif(gif);
+        free(buf);
+        res->seconds += now() - t0;
+        if (res->error)
+            return;
+    }
+}
+
+static void
+print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void
+print_result(const Result *res, int runs, int json)
+{
+    double mbs = 0, fps = 0;
+
+    if (res->seconds > 0) {
+        mbs = res->bytes * (double) runs / res->seconds / 1e6;
+        fps = res->frames * (double) runs / res->seconds;
+    }
+    if (!json) {
+        printf("%-32s %10lld %7d %9.2f %10.1f %8.3f %8.3f  %s\n",
+               res->fname, res->bytes, res->frames, mbs, fps,
+               percentile(res, 50), percentile(res, 99),
+               res->error ? gd_strerror(res->error) : "");
+        return;
+    }
+    printf("    {\"file\": ");
+    print_json_string(res->fname);
+    printf(", \"bytes\": %lld, \"fnv1a\": \"%016llx\", \"frames\": %d, "
+           "\"mb_per_s\": %.3f, \"frames_per_s\": %.3f, \"p50_ms\": %.4f, "
+           "\"p99_ms\": %.4f, \"error\": ", res->bytes,
+           (unsigned long long) res->hash, res->frames, mbs, fps,
+           percentile(res, 50), percentile(res, 99));
+    if (res->error)
+        print_json_string(gd_strerror(res->error));
+    else
+        printf("null");
+    printf("}");
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct rusage ru;
+    Result *results, total;
+    int i, n, json = 0, runs = 5, threads = 1, failed = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-j"))
+            json = 1;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else
+            break;
+    }
+    n = argc - i;
+    if (n < 1 || runs < 1 || threads < 1) {
+        fprintf(stderr, "usage:\n  %s [-j] [-r runs] [-t threads] "
+                "gif-file...\n", argv[0]);
+        return 1;
+    }
+#ifndef GD_THREADS
+    if (threads > 1) {
+        fprintf(stderr, "-t needs gifdec compiled with GD_THREADS\n");
+        return 1;
+    }
+#endif
+    results = calloc(n, sizeof(*results));
+    if (!results)
+        return 1;
+    memset(&total, 0, sizeof(total));
+    total.fname = "total";
+    total.hash = 0xCBF29CE484222325;
+    for (i = 0; i < n; i++) {
+        results[i].fname = argv[argc - n + i];
+        bench_file(&results[i], runs, threads);
+        qsort(results[i].lat, results[i].nlat, sizeof(double), cmp_double);
+        total.bytes += results[i].bytes;
+        /* Fingerprint the whole corpus, in order. */
+        total.hash = (total.hash ^ results[i].hash) * 0x100000001B3;
+        total.frames += results[i].frames;
+        total.seconds += results[i].seconds;
+        failed |= results[i].error != 0;
+    }
+    /* Pool the latencies of all files for the total. */
+    for (i = 0; i < n; i++) {
+        int k;
+        for (k = 0; k < results[i].nlat; k++)
+            add_latency(&total, results[i].lat[k]);
+    }
+    qsort(total.lat, total.nlat, sizeof(double), cmp_double);
+    getrusage(RUSAGE_SELF, &ru);
+    if (json) {
+        printf("{\n  \"runs\": %d,\n  \"threads\": %d,\n  \"files\": [\n",
+               runs, threads);
+        for (i = 0; i < n; i++) {
+            print_result(&results[i], runs, 1);
+            printf(i + 1 < n ? ",\n" : "\n");
+        }
+        printf("  ],\n  \"total\":\n");
+        print_result(&total, runs, 1);
+        printf(",\n  \"peak_rss_kb\": %ld\n}\n", ru.ru_maxrss);
+    } else {
+        printf("%-32s %10s %7s %9s %10s %8s %8s\n", "file", "bytes",
+               "frames", "MB/s", "frames/s", "p50 ms", "p99 ms");
+        for (i = 0; i < n; i++)
+            print_result(&results[i], runs, 0);
+        print_result(&total, runs, 0);
+        printf("peak RSS: %ld KiB\n", ru.ru_maxrss);
+    }
+    for (i = 0; i < n; i++)
+        free(results[i].lat);
+    free(total.lat);
+    free(results);
+    return failed;
+}
@@ -21,10 +21,7 @@ main(int argc, char *argv[])
     SDL_Event event;
     gd_GIF *gif;
     char title[32] = {0};
-    Uint8 *color, *frame;
-    void *addr;
-    int i, j;
-    Uint32 pixel;
+    Uint8 *color;
     int ret, paused, quit;
     Uint32 t0, t1, delay, delta;
 
@@ -37,11 +34,6 @@ main(int argc, char *argv[])
         fprintf(stderr, "Could not open %s\n", argv[1]);
         return 1;
     }
-    frame = malloc(gif->width * gif->height * 3);
-    if (!frame) {
-        fprintf(stderr, "Could not allocate frame\n");
-        return 1;
-    }
     if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER) != 0) {
         SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
         return 1;
@@ -57,11 +49,15 @@ main(int argc, char *argv[])
     SDL_SetRenderDrawColor(renderer, color[0], color[1], color[2], 0x00);
     SDL_RenderClear(renderer);
     SDL_RenderPresent(renderer);
-    surface = SDL_CreateRGBSurface(0, gif->width, gif->height, 32, 0, 0, 0, 0);
+    surface = SDL_CreateRGBSurfaceWithFormat(0, gif->width, gif->height, 32,
+                                             SDL_PIXELFORMAT_BGRA32);
     if (!surface) {
-        SDL_Log("SDL_CreateRGBSurface() failed: %s", SDL_GetError());
+        SDL_Log("SDL_CreateRGBSurfaceWithFormat() failed: %s", SDL_GetError());
         return 1;
     }
+    SDL_LockSurface(surface);
+    gd_render_frame_fmt(gif, surface->pixels, surface->pitch, GD_BGRA);
+    SDL_UnlockSurface(surface);
     paused = 0;
     quit = 0;
     while (1) {
@@ -85,18 +81,12 @@ main(int argc, char *argv[])
         if (ret == -1)
             break;
         SDL_LockSurface(surface);
-        gd_render_frame(gif, frame);
-        color = frame;
-        for (i = 0; i < gif->height; i++) {
-            for (j = 0; j < gif->width; j++) {
-                addr = surface->pixels + (i * surface->pitch + j * sizeof(pixel));
-                pixel = SDL_MapRGB(surface->format, color[0], color[1], color[2]);
-                memcpy(addr, &pixel, sizeof(pixel));
-                color += 3;
-            }
-        }
+        /* Only update the pixels that changed since the last frame. */
+        gd_render_damage(gif, surface->pixels, surface->pitch, GD_BGRA);
         SDL_UnlockSurface(surface);
         texture = SDL_CreateTextureFromSurface(renderer, surface);
+        /* Transparent pixels show the background color. */
+        SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
         SDL_RenderPresent(renderer);
         SDL_DestroyTexture(texture);
@@ -112,7 +102,6 @@ main(int argc, char *argv[])
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
-    free(frame);
     gd_close_gif(gif);
     return 0;
 }
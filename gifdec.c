@@ -1,6 +1,11 @@
+/* clock_gettime() for GD_STATS timings. */
+#if defined(GD_STATS) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "gifdec.h"
 
-#include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,96 +13,618 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifndef GD_NO_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef GD_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef GD_STATS
+#include <time.h>
+#endif
+
+/* NEON compositing is opt-in: define GD_NEON to build it on ARM. */
+#ifdef GD_NO_SIMD
+#undef GD_NEON
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GD_AVX2
+#include <immintrin.h>
+#endif
+#if defined(GD_NEON) && !defined(__ARM_NEON)
+#undef GD_NEON
+#endif
+#ifdef GD_NEON
+#include <arm_neon.h>
+#endif
 
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
-typedef struct Entry {
-    uint16_t length;
-    uint16_t prefix;
-    uint8_t  suffix;
-} Entry;
+/* Kernel bodies are inlined into variants where some of their arguments
+ * are constants, so that branches on those disappear. */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* Code only compiled with GD_STATS, to count and time what happens. */
+#ifdef GD_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+
+#define BUF_SIZE 0x4000
+#define NO_KEY   0xFFFF
+
+/* Where gd_feed() is in the input, as gif->push. */
+enum {
+    PUSH_NONE,   /* not a push handle */
+    PUSH_HEADER, /* before the header */
+    PUSH_NEXT,   /* before the blocks of next frame */
+    PUSH_BLOCKS, /* among the blocks of next frame */
+    PUSH_IMAGE,  /* in its image data */
+    PUSH_TAIL,   /* after the stop code */
+    PUSH_END,    /* after the trailer */
+    PUSH_FAILED
+};
+
+/* LZW bit reader. Bits above nbits in acc are always zero. */
+typedef struct Bits {
+    uint64_t acc;
+    int nbits;
+    int sub_len; /* bytes left in current sub-block */
+    int end;     /* block terminator consumed */
+} Bits;
+
+/* Where the decoder is in the keys of an image, between two keys. */
+typedef struct Decoder {
+    Bits bits;
+    uint8_t *out;
+    uint32_t cap;
+    int direct, interlace;
+    int code_size, key_size;
+    uint16_t nentries;
+    uint32_t pos, prev_pos, prev_len;
+    int rows; /* rows drawn so far, for push decoding */
+} Decoder;
+
+/* LZW decoder state, reused for every frame.
+ * Each string is stored as a run of already decoded pixels. */
+struct gd_LZW {
+    uint32_t offset[0x1000];
+    uint16_t length[0x1000];
+    uint8_t *scratch; /* linear output for frames not decoded in place */
+    uint32_t scratch_size;
+    /* Whole image data, and the bit offsets of the segments of keys that
+     * follow its clear codes, for decoding on several threads. */
+    uint8_t *data;
+    size_t data_size;
+    size_t *segs;
+    int nsegs, segs_size;
+    Decoder push; /* image being fed to gd_feed() */
+    off_t push_start; /* where its blocks start */
+};
+
+/* Canvas, frame and mask buffers as they were right before frame_no + 1. */
+struct gd_Snapshot {
+    int frame_no; /* -1 for an unused slot */
+    off_t offset; /* where frame_no + 1 starts */
+    unsigned stamp; /* last use, for LRU eviction */
+    int covered; /* gif->covered, when there is no mask */
+    uint8_t *data;
+};
+
+/* Record error on gif and return -1. */
+static int
+fail(gd_GIF *gif, int error)
+{
+    /* Past a limit, input comes up short: that is the real reason. */
+    if (gif->error != GD_ERR_LIMIT)
+        gif->error = error;
+    return -1;
+}
+
+#ifdef GD_STATS
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+static void
+begin_phase(gd_GIF *gif, int phase)
+{
+    if (gif->trace)
+        gif->trace(gif, phase, 0);
+    gif->phase_start[phase] = now_ns();
+}
+
+static void
+end_phase(gd_GIF *gif, int phase)
+{
+    gif->stats.ns[phase] += now_ns() - gif->phase_start[phase];
+    if (gif->trace)
+        gif->trace(gif, phase, 1);
+}
+
+#ifdef GD_THREADS
+static void
+add_stats(gd_Stats *a, const gd_Stats *b)
+{
+    int i;
+
+    a->bytes_read += b->bytes_read;
+    a->io_calls += b->io_calls;
+    a->codes += b->codes;
+    a->resets += b->resets;
+    a->pixels += b->pixels;
+    for (i = 0; i < GD_NPHASES; i++)
+        a->ns[i] += b->ns[i];
+}
+#endif
+#endif
+
+/* Memory management through the allocator given at open time.
+ * Without malloc, the C library is used. Without realloc, blocks start
+ * with a header giving their size, so they can be copied to grow them.
+ * Without free, blocks are only freed with the whole allocator. */
+typedef union AllocHeader {
+    size_t size;
+    long double ld;
+    void *p;
+} AllocHeader;
+
+static int
+valid_alloc(const gd_Allocator *a)
+{
+    return a->malloc || (!a->realloc && !a->free);
+}
+
+static void *
+alloc_mem(const gd_Allocator *a, size_t size)
+{
+    AllocHeader *h;
+    void *p;
+
+    if (!a->malloc)
+        return calloc(1, size);
+    if (a->realloc) {
+        p = a->malloc(a->user, size);
+    } else {
+        if (size > SIZE_MAX - sizeof(*h))
+            return NULL;
+        h = a->malloc(a->user, sizeof(*h) + size);
+        if (h)
+            h->size = size;
+        p = h ? &h[1] : NULL;
+    }
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+static void
+free_mem(const gd_Allocator *a, void *ptr)
+{
+    if (!ptr)
+        return;
+    if (!a->malloc)
+        free(ptr);
+    else if (a->free)
+        a->free(a->user, a->realloc ? ptr : (AllocHeader *) ptr - 1);
+}
+
+static void *
+realloc_mem(const gd_Allocator *a, void *ptr, size_t size)
+{
+    void *p;
+
+    if (!a->malloc)
+        return realloc(ptr, size);
+    if (a->realloc)
+        return a->realloc(a->user, ptr, size);
+    p = alloc_mem(a, size);
+    if (p && ptr) {
+        memcpy(p, ptr, MIN(((AllocHeader *) ptr)[-1].size, size));
+        free_mem(a, ptr);
+    }
+    return p;
+}
+
+/* Refill input buffer. Return number of bytes available (0 on EOF).
+ * Memory sources hold all their data in the buffer and never refill;
+ * mapped sources expose their own storage; others read into a block
+ * owned by gif. */
+static size_t
+fill_buf(gd_GIF *gif)
+{
+    ssize_t n;
+    size_t len;
+
+    if (!gif->io.read && !gif->io.map) {
+        if (gif->buf_len < gif->mem_size)
+            fail(gif, GD_ERR_LIMIT); /* cut short by gd_set_limits() */
+        return 0;
+    }
+    gif->buf_off += gif->buf_len;
+    gif->buf_pos = gif->buf_len = 0;
+    if (gif->limits.max_bytes && gif->buf_off >= gif->limits.max_bytes) {
+        fail(gif, GD_ERR_LIMIT);
+        return 0;
+    }
+    if (gif->io.map) {
+        len = 0;
+        gif->buf = gif->io.map(gif->io.user, gif->buf_off, &len);
+        if (gif->buf)
+            gif->buf_len = len;
+    } else {
+        n = gif->io.read(gif->io.user, (uint8_t *) gif->buf, BUF_SIZE);
+        if (n > 0)
+            gif->buf_len = n;
+        else if (n < 0)
+            fail(gif, GD_ERR_IO);
+    }
+    if (gif->limits.max_bytes)
+        gif->buf_len = MIN(gif->buf_len,
+                           (size_t) (gif->limits.max_bytes - gif->buf_off));
+    STATS(gif->stats.io_calls++;)
+    STATS(gif->stats.bytes_read += gif->buf_len;)
+    return gif->buf_len;
+}
+
+/* Read up to len bytes. Return number of bytes actually read. */
+static size_t
+read_data(gd_GIF *gif, void *dst, size_t len)
+{
+    uint8_t *p = dst;
+    size_t n, got = 0;
+
+    while (got < len) {
+        if (gif->buf_pos == gif->buf_len && !fill_buf(gif))
+            break;
+        n = MIN(len - got, gif->buf_len - gif->buf_pos);
+        memcpy(&p[got], &gif->buf[gif->buf_pos], n);
+        gif->buf_pos += n;
+        got += n;
+    }
+    return got;
+}
 
-typedef struct Table {
-    int bulk;
-    int nentries;
-    Entry *entries;
-} Table;
+/* Read one byte. Return 0 on EOF. */
+static uint8_t
+read_byte(gd_GIF *gif)
+{
+    if (gif->buf_pos == gif->buf_len && !fill_buf(gif))
+        return 0;
+    return gif->buf[gif->buf_pos++];
+}
 
 static uint16_t
-read_num(int fd)
+read_num(gd_GIF *gif)
 {
-    uint8_t bytes[2];
+    uint8_t bytes[2] = {0, 0};
 
-    read(fd, bytes, 2);
+    read_data(gif, bytes, 2);
     return bytes[0] + (((uint16_t) bytes[1]) << 8);
 }
 
-gd_GIF *
-gd_open_gif(const char *fname)
+static off_t
+tell(gd_GIF *gif)
+{
+    return gif->buf_off + gif->buf_pos;
+}
+
+/* Set absolute read position, avoiding I/O when it is buffered.
+ * An empty buffer always seeks, since hooks may have moved gif->fd. */
+static void
+seek(gd_GIF *gif, off_t off)
+{
+    size_t n;
+
+    if (gif->buf_len && off >= gif->buf_off &&
+        off <= gif->buf_off + (off_t) gif->buf_len) {
+        gif->buf_pos = off - gif->buf_off;
+        return;
+    }
+    if (!gif->io.read && !gif->io.map) {
+        /* Memory source: clamp to the data. */
+        gif->buf_pos = off < 0 ? 0 : gif->buf_len;
+        return;
+    }
+    if (gif->io.read && !gif->io.seek) {
+        /* Stream without seek callback: can only skip forward. */
+        while (off > tell(gif) &&
+               (gif->buf_pos < gif->buf_len || fill_buf(gif))) {
+            n = MIN((size_t) (off - tell(gif)), gif->buf_len - gif->buf_pos);
+            gif->buf_pos += n;
+        }
+        return;
+    }
+    if (gif->io.read)
+        gif->io.seek(gif->io.user, off, SEEK_SET);
+    gif->buf_off = off;
+    gif->buf_pos = gif->buf_len = 0;
+}
+
+static void
+skip(gd_GIF *gif, off_t n)
+{
+    seek(gif, tell(gif) + n);
+}
+
+/* Move the file descriptor to the current read position, so that user
+ * hooks can read from gif->fd directly. Buffered data is dropped, unless
+ * the whole file is mapped. */
+static off_t
+sync_fd(gd_GIF *gif)
+{
+    off_t off = tell(gif);
+
+    if (gif->fd == -1)
+        return off;
+    lseek(gif->fd, off, SEEK_SET);
+    if (gif->io.read) {
+        gif->buf_off = off;
+        gif->buf_pos = gif->buf_len = 0;
+    }
+    return off;
+}
+
+static ssize_t
+fd_read(void *user, void *buf, size_t len)
+{
+    return read(*(int *) user, buf, len);
+}
+
+static off_t
+fd_seek(void *user, off_t offset, int whence)
+{
+    return lseek(*(int *) user, offset, whence);
+}
+
+static void
+fd_close(void *user)
+{
+    close(*(int *) user);
+}
+
+/* Create a zeroed gd_GIF followed by bufsize bytes of input buffer. */
+static gd_GIF *
+new_gif(const gd_Allocator *alloc, size_t bufsize)
+{
+    static const gd_Allocator std_alloc;
+    gd_GIF *gif;
+
+    if (!alloc)
+        alloc = &std_alloc;
+    if (!valid_alloc(alloc))
+        return NULL;
+    gif = alloc_mem(alloc, sizeof(*gif) + bufsize);
+    if (gif) {
+        gif->alloc = *alloc;
+        gif->fd = -1;
+        gif->buf = (uint8_t *) &gif[1];
+    }
+    return gif;
+}
+
+#ifndef GD_NO_MMAP
+static void
+unmap_close(void *user)
+{
+    gd_GIF *gif = user;
+
+    munmap((void *) gif->buf, gif->mem_size);
+    close(gif->fd);
+}
+
+/* Map a regular file and read it in place, like a memory source.
+ * Return NULL if the file can't be mapped. */
+static gd_GIF *
+map_file(int fd)
+{
+    struct stat st;
+    void *addr;
+    gd_GIF *gif;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (uintmax_t) st.st_size > SIZE_MAX)
+        return NULL;
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    gif = new_gif(NULL, 0);
+    if (!gif) {
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+    gif->fd = fd;
+    gif->io.close = unmap_close;
+    gif->io.user = gif;
+    gif->buf = addr;
+    gif->buf_len = gif->mem_size = st.st_size;
+    STATS(gif->stats.io_calls++;)
+    STATS(gif->stats.bytes_read = st.st_size;)
+    return gif;
+}
+#endif
+
+size_t
+gd_read(gd_GIF *gif, void *buf, size_t len)
+{
+    return read_data(gif, buf, len);
+}
+
+/* Parse header and GCT.
+ * Return GD_OK on success, or the reason for failure. */
+static int
+read_header(gd_GIF *gif)
 {
-    int fd;
     uint8_t sigver[3];
     uint16_t width, height, depth;
-    uint8_t fdsz, bgidx, aspect;
+    uint8_t fdsz, bgidx;
     int gct_sz;
-    gd_GIF *gif;
 
-    fd = open(fname, O_RDONLY);
-    if (fd == -1) return NULL;
     /* Header */
-    read(fd, sigver, 3);
-    if (memcmp(sigver, "GIF", 3) != 0) {
-        fprintf(stderr, "invalid signature\n");
-        goto fail;
-    }
+    if (read_data(gif, sigver, 3) != 3 || memcmp(sigver, "GIF", 3) != 0)
+        return GD_ERR_SIGNATURE;
     /* Version */
-    read(fd, sigver, 3);
-    if (memcmp(sigver, "89a", 3) != 0) {
-        fprintf(stderr, "invalid version\n");
-        goto fail;
-    }
+    if (read_data(gif, sigver, 3) != 3 || memcmp(sigver, "89a", 3) != 0)
+        return GD_ERR_VERSION;
     /* Width x Height */
-    width  = read_num(fd);
-    height = read_num(fd);
+    width  = read_num(gif);
+    height = read_num(gif);
     /* FDSZ */
-    read(fd, &fdsz, 1);
+    fdsz = read_byte(gif);
     /* Presence of GCT */
-    if (!(fdsz & 0x80)) {
-        fprintf(stderr, "no global color table\n");
-        goto fail;
-    }
+    if (!(fdsz & 0x80))
+        return GD_ERR_NO_GCT;
     /* Color Space's Depth */
     depth = ((fdsz >> 4) & 7) + 1;
     /* Ignore Sort Flag. */
     /* GCT Size */
     gct_sz = 1 << ((fdsz & 0x07) + 1);
     /* Background Color Index */
-    read(fd, &bgidx, 1);
-    /* Aspect Ratio */
-    read(fd, &aspect, 1);
-    /* Create gd_GIF Structure. */
-    gif = calloc(1, sizeof(*gif) + 4 * width * height);
-    if (!gif) goto fail;
-    gif->fd = fd;
+    bgidx = read_byte(gif);
+    /* Ignore Aspect Ratio. */
+    skip(gif, 1);
     gif->width  = width;
     gif->height = height;
     gif->depth  = depth;
     /* Read GCT */
     gif->gct.size = gct_sz;
-    read(fd, gif->gct.colors, 3 * gif->gct.size);
+    read_data(gif, gif->gct.colors, 3 * gif->gct.size);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
-    gif->canvas = (uint8_t *) &gif[1];
-    gif->frame = &gif->canvas[3 * width * height];
-    if (gif->bgindex)
-        memset(gif->frame, gif->bgindex, gif->width * gif->height);
-    gif->anim_start = lseek(fd, 0, SEEK_CUR);
-    goto ok;
-fail:
-    close(fd);
-ok:
-    return gif;
+    gif->anim_start = tell(gif);
+    gif->index_end = gif->anim_start;
+    gif->frame_no = -1;
+    gif->lut_key = -1;
+    return GD_OK;
+}
+
+/* Parse header and GCT of a gd_GIF whose input has been set up.
+ * On failure, release everything (including the input), store the
+ * reason in *error and return NULL. */
+static gd_GIF *
+open_gif(gd_GIF *gif, int *error)
+{
+    *error = read_header(gif);
+    if (*error == GD_OK)
+        return gif;
+    /* A read error cuts the header short; report that instead. */
+    if (gif->error)
+        *error = gif->error;
+    gd_close_gif(gif);
+    return NULL;
+}
+
+static gd_GIF *
+open_file(const char *fname, int *error)
+{
+    int fd;
+    gd_GIF *gif;
+
+    fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        *error = GD_ERR_IO;
+        return NULL;
+    }
+#ifndef GD_NO_MMAP
+    gif = map_file(fd);
+    if (gif)
+        return open_gif(gif, error);
+#endif
+    /* Create gd_GIF Structure, with input buffer. */
+    gif = new_gif(NULL, BUF_SIZE);
+    if (!gif) {
+        close(fd);
+        *error = GD_ERR_NOMEM;
+        return NULL;
+    }
+    gif->fd = fd;
+    gif->io.read = fd_read;
+    gif->io.seek = fd_seek;
+    gif->io.close = fd_close;
+    gif->io.user = &gif->fd;
+    return open_gif(gif, error);
+}
+
+gd_GIF *
+gd_open_gif(const char *fname)
+{
+    int error;
+
+    return open_file(fname, &error);
+}
+
+gd_GIF *
+gd_open_gif_ex(const char *fname, int *error)
+{
+    return open_file(fname, error);
+}
+
+static gd_GIF *
+open_memory(const void *data, size_t len, int *error)
+{
+    gd_GIF *gif;
+
+    gif = new_gif(NULL, 0);
+    if (!gif) {
+        *error = GD_ERR_NOMEM;
+        return NULL;
+    }
+    /* Data is read in place: the whole source is the input buffer. */
+    gif->buf = data;
+    gif->buf_len = gif->mem_size = len;
+    STATS(gif->stats.bytes_read = len;)
+    return open_gif(gif, error);
+}
+
+gd_GIF *
+gd_open_gif_memory(const void *data, size_t len)
+{
+    int error;
+
+    return open_memory(data, len, &error);
+}
+
+gd_GIF *
+gd_open_gif_memory_ex(const void *data, size_t len, int *error)
+{
+    return open_memory(data, len, error);
+}
+
+gd_GIF *
+gd_open_gif_io_ex(const gd_IO *io, const gd_Allocator *alloc, int *error)
+{
+    gd_GIF *gif;
+
+    /* Mapped sources need no buffer of their own. */
+    gif = new_gif(alloc, io->map ? 0 : BUF_SIZE);
+    if (!gif) {
+        if (io->close)
+            io->close(io->user);
+        *error = GD_ERR_NOMEM;
+        return NULL;
+    }
+    gif->io = *io;
+    return open_gif(gif, error);
+}
+
+gd_GIF *
+gd_open_gif_io(const gd_IO *io, const gd_Allocator *alloc)
+{
+    int error;
+
+    return gd_open_gif_io_ex(io, alloc, &error);
 }
 
 static void
@@ -106,8 +633,8 @@ discard_sub_blocks(gd_GIF *gif)
     uint8_t size;
 
     do {
-        read(gif->fd, &size, 1);
-        lseek(gif->fd, size, SEEK_CUR);
+        size = read_byte(gif);
+        skip(gif, size);
     } while (size);
 }
 
@@ -118,50 +645,50 @@ read_plain_text_ext(gd_GIF *gif)
         uint16_t tx, ty, tw, th;
         uint8_t cw, ch, fg, bg;
         off_t sub_block;
-        lseek(gif->fd, 1, SEEK_CUR); /* block size = 12 */
-        tx = read_num(gif->fd);
-        ty = read_num(gif->fd);
-        tw = read_num(gif->fd);
-        th = read_num(gif->fd);
-        read(gif->fd, &cw, 1);
-        read(gif->fd, &ch, 1);
-        read(gif->fd, &fg, 1);
-        read(gif->fd, &bg, 1);
-        sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        skip(gif, 1); /* block size = 12 */
+        tx = read_num(gif);
+        ty = read_num(gif);
+        tw = read_num(gif);
+        th = read_num(gif);
+        cw = read_byte(gif);
+        ch = read_byte(gif);
+        fg = read_byte(gif);
+        bg = read_byte(gif);
+        sub_block = sync_fd(gif);
         gif->plain_text(gif, tx, ty, tw, th, cw, ch, fg, bg);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        seek(gif, sub_block);
     } else {
         /* Discard plain text metadata. */
-        lseek(gif->fd, 13, SEEK_CUR);
+        skip(gif, 13);
     }
     /* Discard plain text sub-blocks. */
     discard_sub_blocks(gif);
 }
 
 static void
-read_graphic_control_ext(gd_GIF *gif)
+read_graphic_control_ext(gd_GIF *gif, gd_GCE *gce)
 {
     uint8_t rdit;
 
     /* Discard block size (always 0x04). */
-    lseek(gif->fd, 1, SEEK_CUR);
-    read(gif->fd, &rdit, 1);
-    gif->gce.disposal = (rdit >> 2) & 3;
-    gif->gce.input = rdit & 2;
-    gif->gce.transparency = rdit & 1;
-    gif->gce.delay = read_num(gif->fd);
-    read(gif->fd, &gif->gce.tindex, 1);
+    skip(gif, 1);
+    rdit = read_byte(gif);
+    gce->disposal = (rdit >> 2) & 3;
+    gce->input = rdit & 2;
+    gce->transparency = rdit & 1;
+    gce->delay = read_num(gif);
+    gce->tindex = read_byte(gif);
     /* Skip block terminator. */
-    lseek(gif->fd, 1, SEEK_CUR);
+    skip(gif, 1);
 }
 
 static void
 read_comment_ext(gd_GIF *gif)
 {
     if (gif->comment) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = sync_fd(gif);
         gif->comment(gif);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        seek(gif, sub_block);
     }
     /* Discard comment sub-blocks. */
     discard_sub_blocks(gif);
@@ -174,21 +701,21 @@ read_application_ext(gd_GIF *gif)
     char app_auth_code[3];
 
     /* Discard block size (always 0x0B). */
-    lseek(gif->fd, 1, SEEK_CUR);
+    skip(gif, 1);
     /* Application Identifier. */
-    read(gif->fd, app_id, 8);
+    read_data(gif, app_id, 8);
     /* Application Authentication Code. */
-    read(gif->fd, app_auth_code, 3);
+    read_data(gif, app_auth_code, 3);
     if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
         /* Discard block size (0x03) and constant byte (0x01). */
-        lseek(gif->fd, 2, SEEK_CUR);
-        gif->loop_count = read_num(gif->fd);
+        skip(gif, 2);
+        gif->loop_count = read_num(gif);
         /* Skip block terminator. */
-        lseek(gif->fd, 1, SEEK_CUR);
+        skip(gif, 1);
     } else if (gif->application) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = sync_fd(gif);
         gif->application(gif, app_id, app_auth_code);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        seek(gif, sub_block);
         discard_sub_blocks(gif);
     } else {
         discard_sub_blocks(gif);
@@ -200,13 +727,13 @@ read_ext(gd_GIF *gif)
 {
     uint8_t label;
 
-    read(gif->fd, &label, 1);
+    label = read_byte(gif);
     switch (label) {
     case 0x01:
         read_plain_text_ext(gif);
         break;
     case 0xF9:
-        read_graphic_control_ext(gif);
+        read_graphic_control_ext(gif, &gif->gce);
         break;
     case 0xFE:
         read_comment_ext(gif);
@@ -215,72 +742,71 @@ read_ext(gd_GIF *gif)
         read_application_ext(gif);
         break;
     default:
-        fprintf(stderr, "unknown extension: %02X\n", label);
+        /* Unknown extension: skip its sub-blocks. */
+        discard_sub_blocks(gif);
     }
 }
 
-static Table *
-new_table(int key_size)
+static uint64_t
+load_le64(const uint8_t *p)
 {
-    int key;
-    int init_bulk = MAX(1 << (key_size + 1), 0x100);
-    Table *table = malloc(sizeof(*table) + sizeof(Entry) * init_bulk);
-    if (table) {
-        table->bulk = init_bulk;
-        table->nentries = (1 << key_size) + 2;
-        table->entries = (Entry *) &table[1];
-        for (key = 0; key < (1 << key_size); key++)
-            table->entries[key] = (Entry) {1, 0xFFF, key};
-    }
-    return table;
+    return (uint64_t) p[0]       | (uint64_t) p[1] << 8  |
+           (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+           (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+           (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
 }
 
-/* Add table entry. Return value:
- *  0 on success
- *  +1 if key size must be incremented after this addition
- *  -1 if could not realloc table */
-static int
-add_entry(Table **tablep, uint16_t length, uint16_t prefix, uint8_t suffix)
+/* Top up the bit reservoir with at least 56 bits, or as many as the
+ * sub-blocks have left. */
+static void
+fill_bits(gd_GIF *gif, Bits *bits)
 {
-    Table *table = *tablep;
-    if (table->nentries == table->bulk) {
-        table->bulk *= 2;
-        table = realloc(table, sizeof(*table) + sizeof(Entry) * table->bulk);
-        if (!table) return -1;
-        table->entries = (Entry *) &table[1];
-        *tablep = table;
+    int n;
+
+    while (bits->nbits <= 55) {
+        if (bits->sub_len == 0) {
+            if (bits->end)
+                return;
+            /* Pushed data: wait for the whole sub-block. */
+            if (gif->push && (gif->buf_pos == gif->buf_len ||
+                gif->buf_len - gif->buf_pos <= gif->buf[gif->buf_pos]))
+                return;
+            bits->sub_len = read_byte(gif);
+            if (bits->sub_len == 0) {
+                bits->end = 1;
+                return;
+            }
+        }
+        if (bits->sub_len >= 8 && gif->buf_len - gif->buf_pos >= 8) {
+            /* Fast path: load whole bytes at once and drop the rest. */
+            n = (63 - bits->nbits) >> 3;
+            bits->acc |= load_le64(&gif->buf[gif->buf_pos]) << bits->nbits;
+            bits->nbits += n * 8;
+            bits->acc &= ((uint64_t) 1 << bits->nbits) - 1;
+            gif->buf_pos += n;
+            bits->sub_len -= n;
+        } else {
+            bits->acc |= (uint64_t) read_byte(gif) << bits->nbits;
+            bits->nbits += 8;
+            bits->sub_len--;
+        }
     }
-    table->entries[table->nentries] = (Entry) {length, prefix, suffix};
-    table->nentries++;
-    if ((table->nentries & (table->nentries - 1)) == 0)
-        return 1;
-    return 0;
 }
 
+/* Return next key, or NO_KEY if the data sub-blocks end before it. */
 static uint16_t
-get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *byte)
+get_key(gd_GIF *gif, Bits *bits, int key_size)
 {
-    int bits_read;
-    int rpad;
-    int frag_size;
     uint16_t key;
 
-    key = 0;
-    for (bits_read = 0; bits_read < key_size; bits_read += frag_size) {
-        rpad = (*shift + bits_read) % 8;
-        if (rpad == 0) {
-            /* Update byte. */
-            if (*sub_len == 0)
-                read(gif->fd, sub_len, 1); /* Must be nonzero! */
-            read(gif->fd, byte, 1);
-            (*sub_len)--;
-        }
-        frag_size = MIN(key_size - bits_read, 8 - rpad);
-        key |= ((uint16_t) ((*byte) >> rpad)) << bits_read;
-    }
-    /* Clear extra bits to the left. */
-    key &= (1 << key_size) - 1;
-    *shift = (*shift + key_size) % 8;
+    if (bits->nbits < key_size) {
+        fill_bits(gif, bits);
+        if (bits->nbits < key_size)
+            return NO_KEY;
+    }
+    key = bits->acc & ((1 << key_size) - 1);
+    bits->acc >>= key_size;
+    bits->nbits -= key_size;
     return key;
 }
 
@@ -306,184 +832,2980 @@ interlaced_line_index(int h, int y)
     return y * 2 + 1;
 }
 
-/* Decompress image pixels.
- * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table). */
-static int
-read_image_data(gd_GIF *gif, int interlace)
+/* Copy decoded rows of a frame, from row first on, from a linear buffer
+ * into gif->frame, clipped to the canvas. */
+static void
+map_rows(gd_GIF *gif, const uint8_t *src, int first, uint32_t npix,
+         int interlace)
 {
-    uint8_t sub_len, shift, byte;
-    int init_key_size, key_size, table_is_full;
-    int frm_off, str_len, p, x, y;
-    uint16_t key, clear, stop;
-    int ret;
-    Table *table;
-    Entry entry;
-    off_t start, end;
-
-    read(gif->fd, &byte, 1);
-    key_size = (int) byte;
-    start = lseek(gif->fd, 0, SEEK_CUR);
-    discard_sub_blocks(gif);
-    end = lseek(gif->fd, 0, SEEK_CUR);
-    lseek(gif->fd, start, SEEK_SET);
-    clear = 1 << key_size;
+    int r, y, w;
+    uint32_t n;
+
+    if (gif->fx >= gif->width)
+        return;
+    w = MIN(gif->fw, gif->width - gif->fx);
+    for (r = first; r < gif->fh && (uint32_t) r * gif->fw < npix; r++) {
+        y = interlace ? interlaced_line_index((int) gif->fh, r) : r;
+        if (gif->fy + y >= gif->height)
+            continue;
+        n = MIN((uint32_t) w, npix - (uint32_t) r * gif->fw);
+        memcpy(&gif->frame[(gif->fy + y) * gif->width + gif->fx],
+               &src[r * gif->fw], n);
+    }
+}
+
+static void
+free_lzw(const gd_Allocator *a, struct gd_LZW *lzw)
+{
+    if (!lzw)
+        return;
+    free_mem(a, lzw->scratch);
+    free_mem(a, lzw->data);
+    free_mem(a, lzw->segs);
+    free_mem(a, lzw);
+}
+
+/* Set d up to decode keys into out from pixel pos on, as after a clear
+ * code. The bit reader starts empty. */
+static void
+start_keys(Decoder *d, uint8_t *out, uint32_t pos, uint32_t cap,
+           int code_size)
+{
+    memset(d, 0, sizeof(*d));
+    d->out = out;
+    d->pos = pos;
+    d->cap = cap;
+    d->code_size = code_size;
+    d->key_size = code_size + 1;
+    d->nentries = (1 << code_size) + 2;
+}
+
+/* Decode keys into d->out, until the stop code, the end of the data, an
+ * invalid key, a full output (d->pos is then d->cap), or a clear code at
+ * or after pixel limit.
+ * Strings are written forward, as copies of earlier output: each table
+ * entry points to where its string was first decoded. A min_size other
+ * than 0 is the LZW minimum code size of the data.
+ * Return 1 when done, or 0 if pushed data ran out first (see gd_feed()),
+ * in which case d is where to carry on from. */
+static ALWAYS_INLINE int
+keys_kernel(gd_GIF *gif, Decoder *d, uint32_t limit, int min_size)
+{
+    Bits *bits = &d->bits;
+    uint8_t *out = d->out;
+    int code_size = min_size ? min_size : d->code_size;
+    int key_size = d->key_size;
+    uint16_t key, clear, stop, nentries = d->nentries;
+    uint32_t cap = d->cap, pos = d->pos, prev_pos = d->prev_pos;
+    uint32_t len, prev_len = d->prev_len, off;
+    struct gd_LZW *lzw = gif->lzw;
+    STATS(uint64_t codes = 0, resets = 0;)
+
+    clear = 1 << code_size;
     stop = clear + 1;
-    table = new_table(key_size);
-    key_size++;
-    init_key_size = key_size;
-    sub_len = shift = 0;
-    key = get_key(gif, key_size, &sub_len, &shift, &byte); /* clear code */
-    frm_off = 0;
-    ret = 0;
     while (1) {
+        key = get_key(gif, bits, key_size);
+        STATS(codes++;)
         if (key == clear) {
-            key_size = init_key_size;
-            table->nentries = (1 << (key_size - 1)) + 2;
-            table_is_full = 0;
-        } else if (!table_is_full) {
-            ret = add_entry(&table, str_len + 1, key, entry.suffix);
-            if (ret == -1) {
-                free(table);
-                return -1;
-            }
-            if (table->nentries == 0x1000) {
-                ret = 0;
-                table_is_full = 1;
-            }
+            STATS(resets++;)
+            if (pos >= limit)
+                break;
+            key_size = code_size + 1;
+            nentries = clear + 2;
+            prev_len = 0;
+            continue;
+        }
+        if (key == stop || key == NO_KEY)
+            break;
+        if (prev_len && nentries < 0x1000) {
+            /* New string: previous one plus the first pixel of this one,
+             * which is right after it in the output. */
+            lzw->offset[nentries] = prev_pos;
+            lzw->length[nentries] = prev_len + 1;
+            nentries++;
+            if (nentries == (1 << key_size) && key_size < 12)
+                key_size++;
         }
-        key = get_key(gif, key_size, &sub_len, &shift, &byte);
-        if (key == clear) continue;
-        if (key == stop) break;
-        if (ret == 1) key_size++;
-        entry = table->entries[key];
-        str_len = entry.length;
-        while (1) {
-            p = frm_off + entry.length - 1;
-            x = p % gif->fw;
-            y = p / gif->fw;
-            if (interlace)
-                y = interlaced_line_index((int) gif->fh, y);
-            gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
-            if (entry.prefix == 0xFFF)
+        if (key < clear) {
+            if (pos == cap)
                 break;
-            else
-                entry = table->entries[entry.prefix];
+            out[pos] = key;
+            len = 1;
+        } else if (key < nentries && prev_len) {
+            off = lzw->offset[key];
+            len = MIN(lzw->length[key], cap - pos);
+            if (off + len <= pos) {
+                memcpy(&out[pos], &out[off], len);
+            } else {
+                /* Just added entry: its last pixel is its first one. */
+                memcpy(&out[pos], &out[off], len - 1);
+                out[pos + len - 1] = out[off];
+            }
+            if (len < lzw->length[key]) {
+                pos = cap;
+                break;
+            }
+        } else {
+            break; /* invalid code */
         }
-        frm_off += str_len;
-        if (key < table->nentries - 1 && !table_is_full)
-            table->entries[table->nentries - 1].suffix = entry.suffix;
+        prev_pos = pos;
+        prev_len = len;
+        pos += len;
     }
-    free(table);
-    read(gif->fd, &sub_len, 1); /* Must be zero! */
-    lseek(gif->fd, end, SEEK_SET);
-    return 0;
+    d->key_size = key_size;
+    d->nentries = nentries;
+    d->pos = pos;
+    d->prev_pos = prev_pos;
+    d->prev_len = prev_len;
+    STATS(gif->stats.codes += codes - (key == NO_KEY);)
+    STATS(gif->stats.resets += resets;)
+    return key != NO_KEY || bits->end;
 }
 
-/* Read image.
- * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table). */
+typedef int (*Keys)(gd_GIF *gif, Decoder *d, uint32_t limit);
+
+#define KEYS_VARIANT(name, min_size) \
+    static int \
+    name(gd_GIF *gif, Decoder *d, uint32_t limit) \
+    { \
+        return keys_kernel(gif, d, limit, min_size); \
+    }
+
+KEYS_VARIANT(decode_keys_any, 0)
+KEYS_VARIANT(decode_keys_2, 2)
+KEYS_VARIANT(decode_keys_3, 3)
+KEYS_VARIANT(decode_keys_4, 4)
+KEYS_VARIANT(decode_keys_5, 5)
+KEYS_VARIANT(decode_keys_6, 6)
+KEYS_VARIANT(decode_keys_7, 7)
+KEYS_VARIANT(decode_keys_8, 8)
+
+/* Run the keys_kernel() variant for d, specialized for the usual minimum
+ * code sizes, those of palettes of up to 256 colors. */
 static int
-read_image(gd_GIF *gif)
+decode_keys(gd_GIF *gif, Decoder *d, uint32_t limit)
 {
-    uint8_t fisrz;
-    int interlace;
+    static const Keys decoders[] = {
+        decode_keys_any, decode_keys_any, decode_keys_2, decode_keys_3,
+        decode_keys_4, decode_keys_5, decode_keys_6, decode_keys_7,
+        decode_keys_8
+    };
 
-    /* Image Descriptor. */
-    gif->fx = read_num(gif->fd);
-    gif->fy = read_num(gif->fd);
-    gif->fw = read_num(gif->fd);
-    gif->fh = read_num(gif->fd);
-    read(gif->fd, &fisrz, 1);
-    interlace = fisrz & 0x40;
-    /* Ignore Sort Flag. */
-    /* Local Color Table? */
-    if (fisrz & 0x80) {
-        /* Read LCT */
-        gif->lct.size = 1 << ((fisrz & 0x07) + 1);
-        read(gif->fd, gif->lct.colors, 3 * gif->lct.size);
-        gif->palette = &gif->lct;
-    } else
-        gif->palette = &gif->gct;
-    /* Image Data. */
-    return read_image_data(gif, interlace);
+    if (d->code_size <= 8)
+        return decoders[d->code_size](gif, d, limit);
+    return decode_keys_any(gif, d, limit);
 }
 
-static void
-render_frame_rect(gd_GIF *gif, uint8_t *buffer)
+#ifdef GD_THREADS
+/* Frames from this size on may be decoded on several threads. */
+#define PAR_MIN_PIXELS (1 << 21)
+
+/* A run of segments, [first, last), decoded by one thread into out. The
+ * first chunk decodes straight into the frame; the others decode into
+ * buffers of their own, grown up to cap as needed, and are copied into
+ * place once the length of the chunks before them is known. */
+typedef struct Chunk {
+    gd_GIF reader; /* over the image data, with its own LZW table */
+    const size_t *segs;
+    int nsegs; /* of the whole image */
+    int first, last, code_size;
+    uint8_t *out;
+    uint32_t size, cap, len; /* of out, at most, and decoded so far */
+    int broken; /* stopped before its last segment ended */
+    int nomem;  /* out couldn't grow */
+} Chunk;
+
+/* Bit offset of the next key in the image data. */
+static size_t
+bit_offset(gd_GIF *gif, Bits *bits)
 {
-    int i, j, k;
-    uint8_t index, *color;
-    i = gif->fy * gif->width + gif->fx;
-    for (j = 0; j < gif->fh; j++) {
-        for (k = 0; k < gif->fw; k++) {
-            index = gif->frame[(gif->fy + j) * gif->width + gif->fx + k];
-            color = &gif->palette->colors[index*3];
-            if (!gif->gce.transparency || index != gif->gce.tindex)
-                memcpy(&buffer[(i+k)*3], color, 3);
-        }
-        i += gif->width;
+    return (size_t) gif->buf_pos * 8 - bits->nbits;
+}
+
+/* Record that a segment starts at bit.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+add_segment(gd_GIF *gif, size_t bit)
+{
+    struct gd_LZW *lzw = gif->lzw;
+    size_t *segs;
+    int size;
+
+    if (lzw->nsegs == lzw->segs_size) {
+        size = lzw->segs_size ? lzw->segs_size * 2 : 64;
+        segs = realloc_mem(&gif->alloc, lzw->segs, size * sizeof(*segs));
+        if (!segs)
+            return -1;
+        lzw->segs = segs;
+        lzw->segs_size = size;
     }
+    lzw->segs[lzw->nsegs++] = bit;
+    return 0;
+}
+
+/* Find the segments of the nbits of image data in lzw->data, the keys
+ * that follow each clear code, without decoding them: only count keys,
+ * to know their width, since the string table grows by one entry per
+ * key. The first segment starts with the data. Scanning stops at the stop
+ * code or the end of the data. Invalid keys aren't looked for: decoding
+ * their segment stops early, and nothing after it is used. If out of
+ * memory, the last segment found just runs to the end, which only means
+ * less parallelism. */
+static void
+scan_segments(gd_GIF *gif, size_t nbits, int code_size)
+{
+    const uint8_t *data = gif->lzw->data;
+    uint16_t key, clear = 1 << code_size, nentries = clear + 2;
+    int key_size = code_size + 1, first = 1;
+    size_t bit = 0;
+
+    gif->lzw->nsegs = 0;
+    if (add_segment(gif, 0) == -1)
+        return;
+    /* The data is padded, so 8 bytes can be loaded from any key. */
+    while (bit + key_size <= nbits) {
+        key = (load_le64(&data[bit / 8]) >> bit % 8) & ((1 << key_size) - 1);
+        bit += key_size;
+        if (key == clear) {
+            if (add_segment(gif, bit) == -1)
+                return;
+            key_size = code_size + 1;
+            nentries = clear + 2;
+            first = 1;
+            continue;
+        }
+        if (key == clear + 1)
+            return;
+        if (!first && nentries < 0x1000) {
+            nentries++;
+            if (nentries == (1 << key_size) && key_size < 12)
+                key_size++;
+        }
+        first = 0;
+    }
+}
+
+/* Decode the segments of chunk c, one at a time, each ending at the
+ * clear code that starts the next one. */
+static void *
+decode_chunk(void *arg)
+{
+    Chunk *c = arg;
+    gd_GIF *r = &c->reader;
+    Decoder d;
+    uint8_t *out;
+    size_t bit, size;
+    int k;
+    STATS(gd_Stats stats;)
+
+    for (k = c->first; k < c->last; k++) {
+        STATS(stats = r->stats;)
+        bit = c->segs[k];
+        start_keys(&d, c->out, c->len, c->size, c->code_size);
+        r->buf_pos = bit / 8;
+        d.bits.sub_len = r->buf_len - r->buf_pos;
+        d.bits.end = 1;
+        if (bit % 8)
+            get_key(r, &d.bits, bit % 8);
+        decode_keys(r, &d, k + 1 < c->nsegs ? 0 : UINT32_MAX);
+        if (k + 1 < c->nsegs && bit_offset(r, &d.bits) == c->segs[k+1]) {
+            c->len = d.pos;
+            continue;
+        }
+        if (d.pos == c->size && c->size < c->cap) {
+            /* Out of room: decode this segment again into more. */
+            size = MIN((uint64_t) c->size * 2, c->cap);
+            out = realloc_mem(&r->alloc, c->out, size);
+            if (out) {
+                STATS(r->stats = stats;)
+                c->out = out;
+                c->size = size;
+                k--;
+                continue;
+            }
+            c->nomem = 1;
+        }
+        c->len = d.pos;
+        c->broken = k + 1 < c->nsegs;
+        break;
+    }
+    return NULL;
+}
+
+/* Number of threads to decode a frame on: as many as asked for, but no
+ * more than the CPUs online. */
+static int
+decode_threads(gd_GIF *gif)
+{
+    int n = gif->decode_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0 && ncpu < n)
+        n = (int) ncpu;
+#endif
+    return n;
+}
+
+/* Read all the data sub-blocks of an image into lzw->data, followed by
+ * 8 zero bytes. Return the length or -1 on out-of-memory. */
+static int
+read_sub_blocks(gd_GIF *gif)
+{
+    struct gd_LZW *lzw = gif->lzw;
+    size_t len = 0, size;
+    uint8_t *data, n;
+
+    while ((n = read_byte(gif))) {
+        if (len + n + 8 > lzw->data_size) {
+            size = MAX(lzw->data_size * 2, 0x10000);
+            data = size <= INT_MAX ?
+                   realloc_mem(&gif->alloc, lzw->data, size) : NULL;
+            if (!data) {
+                discard_sub_blocks(gif);
+                return -1;
+            }
+            lzw->data = data;
+            lzw->data_size = size;
+        }
+        len += read_data(gif, &lzw->data[len], n);
+    }
+    if (lzw->data)
+        memset(&lzw->data[len], 0, 8);
+    return (int) len;
+}
+
+/* Decode a large image on several threads. After a clear code, the LZW
+ * table starts over, so the segments between clear codes can be decoded
+ * independently. A quick pass over the keys finds where each segment
+ * starts, without decoding any, and the segments are then split evenly
+ * between the threads by data size. Each thread decodes into a buffer
+ * of its own, and the buffers are then copied one after the other.
+ * Return the number of pixels decoded, or -1 on out-of-memory. */
+static long
+decode_parallel(gd_GIF *gif, Decoder *d)
+{
+    struct gd_LZW *lzw = gif->lzw;
+    Chunk *c, *chunks;
+    pthread_t *threads;
+    uint32_t npix = 0, m;
+    size_t nbits, size, target;
+    int len, n, i, k, started, ret = 0;
+
+    len = read_sub_blocks(gif);
+    n = decode_threads(gif);
+    chunks = len == -1 ? NULL : alloc_mem(&gif->alloc, n * sizeof(*chunks));
+    threads = alloc_mem(&gif->alloc, n * sizeof(*threads));
+    if (!chunks || !threads) {
+        free_mem(&gif->alloc, chunks);
+        free_mem(&gif->alloc, threads);
+        return fail(gif, GD_ERR_NOMEM);
+    }
+    nbits = (size_t) len * 8;
+    scan_segments(gif, nbits, d->code_size);
+    if (!lzw->nsegs) {
+        n = 0;
+        ret = fail(gif, GD_ERR_NOMEM);
+        goto done;
+    }
+    /* Start each chunk at the first segment past its share of the data. */
+    for (i = 0, k = 0; i < n && k < lzw->nsegs; i++) {
+        c = &chunks[i];
+        target = nbits / n * (i + 1);
+        memset(c, 0, sizeof(*c));
+        c->reader.alloc = gif->alloc;
+        c->reader.buf = lzw->data;
+        c->reader.buf_len = len;
+        c->segs = lzw->segs;
+        c->nsegs = lzw->nsegs;
+        c->code_size = d->code_size;
+        c->cap = d->cap;
+        c->first = k;
+        while (++k < lzw->nsegs && lzw->segs[k] < target)
+            ;
+        c->last = i + 1 < n ? k : lzw->nsegs;
+        k = c->last;
+    }
+    n = i;
+    chunks[0].out = d->out;
+    chunks[0].size = d->cap;
+    chunks[0].reader.lzw = lzw;
+    for (i = 1; i < n; i++) {
+        /* Guess a bit more than the chunk's share of pixels. */
+        c = &chunks[i];
+        size = (c->last < c->nsegs ? c->segs[c->last] : nbits) -
+               c->segs[c->first];
+        size = (uint64_t) d->cap * size / nbits;
+        c->size = (uint32_t) MIN(size + size / 4 + 0x10000, d->cap);
+        c->out = alloc_mem(&gif->alloc, c->size);
+        c->reader.lzw = alloc_mem(&gif->alloc, sizeof(*lzw));
+        if (!c->out || !c->reader.lzw) {
+            ret = fail(gif, GD_ERR_NOMEM);
+            n = i + 1;
+            goto done;
+        }
+    }
+    for (started = 1; started < n; started++)
+        if (pthread_create(&threads[started], NULL, decode_chunk,
+                           &chunks[started]))
+            break;
+    /* The calling thread decodes what couldn't be handed out. */
+    for (i = started; i < n; i++)
+        decode_chunk(&chunks[i]);
+    decode_chunk(&chunks[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    /* Place each chunk right after the ones before, up to the first that
+     * stopped early, as that's where decoding alone would have stopped. */
+    npix = chunks[0].len;
+    for (i = 1; i < n && !chunks[i-1].broken && npix < d->cap; i++) {
+        m = MIN(chunks[i].len, d->cap - npix);
+        memcpy(&d->out[npix], chunks[i].out, m);
+        npix += m;
+        if (chunks[i].nomem)
+            ret = fail(gif, GD_ERR_NOMEM);
+    }
+done:
+    STATS(for (i = 0; i < n; i++) add_stats(&gif->stats, &chunks[i].reader.stats);)
+    for (i = 1; i < n; i++) {
+        free_mem(&gif->alloc, chunks[i].out);
+        free_mem(&gif->alloc, chunks[i].reader.lzw);
+    }
+    free_mem(&gif->alloc, chunks);
+    free_mem(&gif->alloc, threads);
+    return ret == -1 ? -1 : (long) npix;
+}
+#endif
+
+/* Read the LZW code size, and set d up to decode the current frame.
+ * Frames that span whole canvas rows are decoded straight into
+ * gif->frame; others go through a linear buffer and are then mapped row
+ * by row.
+ * Return 0 on success or -1 on error (invalid LZW code size, or
+ * out-of-memory w.r.t. linear buffer). */
+static int
+start_image_data(gd_GIF *gif, Decoder *d, int interlace)
+{
+    int code_size, direct;
+    uint32_t cap;
+    uint8_t *out;
+    struct gd_LZW *lzw = gif->lzw;
+
+    code_size = (int) read_byte(gif);
+    if (code_size < 1 || code_size > 11) {
+        discard_sub_blocks(gif);
+        return fail(gif, GD_ERR_LZW);
+    }
+    cap = (uint32_t) gif->fw * gif->fh;
+    direct = !interlace && gif->fx == 0 && gif->fw == gif->width &&
+             gif->fy + gif->fh <= gif->height;
+    if (direct) {
+        out = &gif->frame[gif->fy * gif->width];
+    } else {
+        /* Pixels that can't land on the canvas are not needed. */
+        cap = MIN(cap, (uint32_t) gif->width * gif->height);
+        if (cap > lzw->scratch_size) {
+            out = realloc_mem(&gif->alloc, lzw->scratch, cap);
+            if (!out) {
+                discard_sub_blocks(gif);
+                return fail(gif, GD_ERR_NOMEM);
+            }
+            lzw->scratch = out;
+            lzw->scratch_size = cap;
+        }
+        out = lzw->scratch;
+    }
+    start_keys(d, out, 0, cap, code_size);
+    d->direct = direct;
+    d->interlace = interlace;
+    return 0;
+}
+
+/* Decompress image pixels.
+ * Return 0 on success or -1 on error (see start_image_data()). */
+static int
+read_image_data(gd_GIF *gif, int interlace)
+{
+    Decoder d;
+    int ret = 0;
+
+    if (start_image_data(gif, &d, interlace) == -1)
+        return -1;
+    STATS(begin_phase(gif, GD_PHASE_DECODE);)
+#ifdef GD_THREADS
+    if (d.cap >= PAR_MIN_PIXELS && decode_threads(gif) > 1) {
+        long n = decode_parallel(gif, &d);
+        if (n == -1)
+            ret = -1;
+        else if (!d.direct)
+            map_rows(gif, d.out, 0, n, interlace);
+        STATS(end_phase(gif, GD_PHASE_DECODE);)
+        return ret;
+    }
+#endif
+    decode_keys(gif, &d, UINT32_MAX);
+    if (!d.direct)
+        map_rows(gif, d.out, 0, d.pos, interlace);
+    STATS(end_phase(gif, GD_PHASE_DECODE);)
+    if (!d.bits.end) {
+        /* Skip whatever follows the stop code, up to the terminator. */
+        skip(gif, d.bits.sub_len);
+        discard_sub_blocks(gif);
+    }
+    return ret;
+}
+
+/* Leave compact mode, converting the canvas to RGB.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+expand_canvas(gd_GIF *gif)
+{
+    size_t i, n = (size_t) gif->width * gif->height;
+    uint8_t *canvas, *mask;
+
+    canvas = alloc_mem(&gif->alloc, (gif->mask ? 5 : 4) * n);
+    if (!canvas)
+        return fail(gif, GD_ERR_NOMEM);
+    mask = gif->mask ? &canvas[4*n] : NULL;
+    memset(canvas, 0, 3 * n);
+    for (i = 0; i < n; i++) {
+        if (mask) {
+            if (gif->mask[i])
+                memcpy(&canvas[i*3], &gif->gct.colors[gif->canvas[i] * 3], 3);
+            mask[i] = gif->mask[i] == 0xFF ? 0xFF : 0;
+        } else if (gif->covered) {
+            memcpy(&canvas[i*3], &gif->gct.colors[gif->canvas[i] * 3], 3);
+        }
+    }
+    memcpy(&canvas[3*n], gif->frame, n);
+    free_mem(&gif->alloc, gif->canvas);
+    gif->canvas = canvas;
+    gif->frame = &canvas[3*n];
+    gif->mask = mask;
+    gif->compact = 0;
+    /* Snapshots of the compact canvas can't be restored anymore. */
+    if (gif->nsnaps &&
+        gd_set_snapshots(gif, gif->snap_interval, gif->snap_budget) == -1)
+        return -1;
+    return 0;
+}
+
+/* Keep the canvas as GCT indices instead of RGB colors, until a frame
+ * with a local palette is read. Only works before the first frame.
+ * Return 0 on success or -1 if the canvas is already allocated. */
+int
+gd_set_compact(gd_GIF *gif)
+{
+    if (gif->canvas)
+        return -1;
+    gif->compact = 1;
+    return 0;
+}
+
+/* Read Image Descriptor and LCT.
+ * Return the interlace flag, or -1 on out-of-memory. */
+static int
+read_image_desc(gd_GIF *gif)
+{
+    uint8_t fisrz;
+    int interlace;
+
+    /* Image Descriptor. */
+    gif->fx = read_num(gif);
+    gif->fy = read_num(gif);
+    gif->fw = read_num(gif);
+    gif->fh = read_num(gif);
+    fisrz = read_byte(gif);
+    interlace = fisrz & 0x40;
+    /* Ignore Sort Flag. */
+    /* Local Color Table? */
+    if (fisrz & 0x80) {
+        /* Read LCT */
+        gif->lct.size = 1 << ((fisrz & 0x07) + 1);
+        read_data(gif, gif->lct.colors, 3 * gif->lct.size);
+        gif->palette = &gif->lct;
+        gif->lut_key = -1;
+        if (gif->compact && expand_canvas(gif) == -1)
+            return -1;
+    } else
+        gif->palette = &gif->gct;
+    return interlace;
+}
+
+/* Size of the part of the current frame that lies on the canvas. */
+static void
+frame_clip(gd_GIF *gif, int *w, int *h)
+{
+    *w = gif->fx < gif->width ? MIN(gif->fw, gif->width - gif->fx) : 0;
+    *h = gif->fy < gif->height ? MIN(gif->fh, gif->height - gif->fy) : 0;
+}
+
+/* Bytes per canvas pixel: an RGB color, or a GCT index in compact mode. */
+static int
+canvas_bpp(gd_GIF *gif)
+{
+    return gif->compact ? 1 : 3;
+}
+
+/* Size of the canvas, frame and mask buffers together. */
+static size_t
+buffers_size(gd_GIF *gif)
+{
+    return (canvas_bpp(gif) + 1 + !!gif->mask) *
+           (size_t) gif->width * gif->height;
+}
+
+/* Fill gif->lut with the canvas pixel of each index: R, G, B, then 0xFF,
+ * or 0 for the transparent index. The table only depends on the palette
+ * and GCE, so it is kept while frames use the same ones. */
+static void
+build_lut(gd_GIF *gif)
+{
+    int i, key;
+
+    key = (gif->palette == &gif->lct) << 9 | gif->gce.transparency << 8 |
+          gif->gce.tindex;
+    if (key == gif->lut_key)
+        return;
+    for (i = 0; i < 0x100; i++) {
+        memcpy(gif->lut[i], &gif->palette->colors[i*3], 3);
+        gif->lut[i][3] = 0xFF;
+    }
+    if (gif->gce.transparency)
+        gif->lut[gif->gce.tindex][3] = 0;
+    gif->lut_key = key;
+}
+
+/* Blit kernels: draw n pixels of indices src through lut into the RGB row
+ * dst and its coverage row mask, skipping transparent pixels if any.
+ * Each comes in four variants, for frames without and with transparency,
+ * and for canvases without a mask, which are already fully covered. */
+typedef void (*Blit)(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst,
+                     uint8_t *mask, int n);
+
+#define BLIT_VARIANT(attr, name, suffix, transparency, masked) \
+    attr static void \
+    name##suffix(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst, \
+                 uint8_t *mask, int n) \
+    { \
+        name##_kernel(lut, src, dst, mask, n, transparency, masked); \
+    }
+
+#define BLIT_VARIANTS(attr, name) \
+    BLIT_VARIANT(attr, name, _opaque, 0, 1) \
+    BLIT_VARIANT(attr, name, _keyed, 1, 1) \
+    BLIT_VARIANT(attr, name, _opaque_covered, 0, 0) \
+    BLIT_VARIANT(attr, name, _keyed_covered, 1, 0)
+
+static ALWAYS_INLINE void
+blit_scalar_kernel(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst,
+                   uint8_t *mask, int n, int transparency, int masked)
+{
+    const uint8_t *c;
+    int k;
+
+    if (n <= 0)
+        return;
+    if (!transparency) {
+        /* Store 4 bytes, the 4th being overwritten by the next pixel,
+         * except for the last one. */
+        for (k = 0; k < n - 1; k++)
+            memcpy(&dst[k*3], lut[src[k]], 4);
+        memcpy(&dst[k*3], lut[src[k]], 3);
+        if (masked)
+            memset(mask, 0xFF, n);
+        return;
+    }
+    for (k = 0; k < n; k++) {
+        c = lut[src[k]];
+        if (c[3]) {
+            memcpy(&dst[k*3], c, 3);
+            if (masked)
+                mask[k] = 0xFF;
+        }
+    }
+}
+
+BLIT_VARIANTS(, blit_scalar)
+
+#ifdef GD_AVX2
+/* Pack the RGB bytes of 16 table entries, in 2 vectors of 8, to 48
+ * contiguous bytes, the 4th byte of each entry being dropped by shuf. */
+__attribute__((target("avx2")))
+static void
+pack48(__m256i a, __m256i b, __m256i shuf, __m128i out[3])
+{
+    __m128i c0, c1, c2, c3;
+
+    a = _mm256_shuffle_epi8(a, shuf);
+    b = _mm256_shuffle_epi8(b, shuf);
+    c0 = _mm256_castsi256_si128(a);
+    c1 = _mm256_extracti128_si256(a, 1);
+    c2 = _mm256_castsi256_si128(b);
+    c3 = _mm256_extracti128_si256(b, 1);
+    out[0] = _mm_or_si128(c0, _mm_slli_si128(c1, 12));
+    out[1] = _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8));
+    out[2] = _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4));
+}
+
+/* Gather 16 table entries at a time and store them as 48 RGB bytes, or
+ * blend them with the canvas where their alpha byte is set. */
+__attribute__((target("avx2")))
+static ALWAYS_INLINE void
+blit_avx2_kernel(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst,
+                 uint8_t *mask, int n, int transparency, int masked)
+{
+    const __m256i rgb = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i spread = _mm256_setr_epi8(
+        3, 3, 3, 7, 7, 7, 11, 11, 11, 15, 15, 15, -1, -1, -1, -1,
+        3, 3, 3, 7, 7, 7, 11, 11, 11, 15, 15, 15, -1, -1, -1, -1);
+    const __m256i alpha = _mm256_setr_epi8(
+        3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i px0, px1, a0, a1;
+    __m128i out[3], sel[3], m;
+    __m128i *d;
+    int i, k;
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        px0 = _mm256_i32gather_epi32((const int *) lut, _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *) &src[k])), 4);
+        px1 = _mm256_i32gather_epi32((const int *) lut, _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i *) &src[k+8])), 4);
+        pack48(px0, px1, rgb, out);
+        d = (__m128i *) &dst[k*3];
+        if (!transparency) {
+            for (i = 0; i < 3; i++)
+                _mm_storeu_si128(&d[i], out[i]);
+            continue;
+        }
+        pack48(px0, px1, spread, sel);
+        for (i = 0; i < 3; i++)
+            _mm_storeu_si128(&d[i], _mm_blendv_epi8(_mm_loadu_si128(&d[i]),
+                                                    out[i], sel[i]));
+        if (!masked)
+            continue;
+        a0 = _mm256_shuffle_epi8(px0, alpha);
+        a1 = _mm256_shuffle_epi8(px1, alpha);
+        m = _mm_unpacklo_epi64(
+            _mm_unpacklo_epi32(_mm256_castsi256_si128(a0),
+                               _mm256_extracti128_si256(a0, 1)),
+            _mm_unpacklo_epi32(_mm256_castsi256_si128(a1),
+                               _mm256_extracti128_si256(a1, 1)));
+        m = _mm_or_si128(m, _mm_loadu_si128((const __m128i *) &mask[k]));
+        _mm_storeu_si128((__m128i *) &mask[k], m);
+    }
+    if (!masked)
+        mask = NULL;
+    else if (!transparency)
+        memset(mask, 0xFF, k);
+    blit_scalar_kernel(lut, &src[k], &dst[k*3], mask ? &mask[k] : NULL,
+                       n - k, transparency, masked);
+}
+
+BLIT_VARIANTS(__attribute__((target("avx2"))), blit_avx2)
+#endif
+
+#ifdef GD_NEON
+/* Look up 16 pixels, split them into R, G, B and alpha planes, and store
+ * them interleaved again, keeping canvas pixels where alpha is 0. */
+static ALWAYS_INLINE void
+blit_neon_kernel(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst,
+                 uint8_t *mask, int n, int transparency, int masked)
+{
+    uint8_t tmp[64];
+    uint8x16x4_t px;
+    uint8x16x3_t rgb, old;
+    int i, k;
+
+    for (k = 0; k + 16 <= n; k += 16) {
+        for (i = 0; i < 16; i++)
+            memcpy(&tmp[i*4], lut[src[k+i]], 4);
+        px = vld4q_u8(tmp);
+        rgb.val[0] = px.val[0];
+        rgb.val[1] = px.val[1];
+        rgb.val[2] = px.val[2];
+        if (transparency) {
+            old = vld3q_u8(&dst[k*3]);
+            for (i = 0; i < 3; i++)
+                rgb.val[i] = vbslq_u8(px.val[3], rgb.val[i], old.val[i]);
+            if (masked)
+                vst1q_u8(&mask[k], vorrq_u8(vld1q_u8(&mask[k]), px.val[3]));
+        }
+        vst3q_u8(&dst[k*3], rgb);
+    }
+    if (!masked)
+        mask = NULL;
+    else if (!transparency)
+        memset(mask, 0xFF, k);
+    blit_scalar_kernel(lut, &src[k], &dst[k*3], mask ? &mask[k] : NULL,
+                       n - k, transparency, masked);
+}
+
+BLIT_VARIANTS(, blit_neon)
+#endif
+
+/* Kernel for compact mode, where the canvas holds indices. */
+static ALWAYS_INLINE void
+blit_index_kernel(uint8_t (*lut)[4], const uint8_t *src, uint8_t *dst,
+                  uint8_t *mask, int n, int transparency, int masked)
+{
+    int k;
+
+    if (!transparency) {
+        memcpy(dst, src, n);
+        if (masked)
+            memset(mask, 0xFF, n);
+        return;
+    }
+    for (k = 0; k < n; k++) {
+        if (lut[src[k]][3]) {
+            dst[k] = src[k];
+            if (masked)
+                mask[k] = 0xFF;
+        }
+    }
+}
+
+BLIT_VARIANTS(, blit_index)
+
+/* Pick the fastest kernel this CPU can run, for a frame with or without
+ * transparency, onto a canvas with or without a mask. */
+static Blit
+select_blit(int compact, int transparency, int masked)
+{
+#define PICK(name) (masked ? \
+    (transparency ? name##_keyed : name##_opaque) : \
+    (transparency ? name##_keyed_covered : name##_opaque_covered))
+    if (compact)
+        return PICK(blit_index);
+#ifdef GD_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return PICK(blit_avx2);
+#endif
+#ifdef GD_NEON
+    return PICK(blit_neon);
+#endif
+    return PICK(blit_scalar);
+#undef PICK
+}
+
+/* Set r to the part of the current frame that lies on the canvas. */
+static void
+frame_rect(gd_GIF *gif, gd_Rect *r)
+{
+    int w, h;
+
+    frame_clip(gif, &w, &h);
+    if (!w || !h) {
+        memset(r, 0, sizeof(*r));
+        return;
+    }
+    r->x = gif->fx;
+    r->y = gif->fy;
+    r->w = w;
+    r->h = h;
+}
+
+/* Grow r to the bounding box of r and s. */
+static void
+add_rect(gd_Rect *r, const gd_Rect *s)
+{
+    int x1, y1;
+
+    if (!s->w || !s->h)
+        return;
+    if (!r->w || !r->h) {
+        *r = *s;
+        return;
+    }
+    x1 = MAX(r->x + r->w, s->x + s->w);
+    y1 = MAX(r->y + r->h, s->y + s->h);
+    r->x = MIN(r->x, s->x);
+    r->y = MIN(r->y, s->y);
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+}
+
+/* Add frame non-transparent pixels to canvas, and mark them opaque. */
+static void
+render_frame_rect(gd_GIF *gif)
+{
+    int i, j, w, h, px;
+    Blit blit;
+    frame_clip(gif, &w, &h);
+    if (!w || !h)
+        return;
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    build_lut(gif);
+    blit = select_blit(gif->compact, gif->gce.transparency, !!gif->mask);
+    px = canvas_bpp(gif);
+    i = gif->fy * gif->width + gif->fx;
+    if (w == gif->width && (uint64_t) w * h <= INT_MAX) {
+        /* Whole rows are contiguous: draw them in one run. */
+        w *= h;
+        h = 1;
+    }
+    for (j = 0; j < h; j++, i += gif->width)
+        blit(gif->lut, &gif->frame[i], &gif->canvas[i * px],
+             gif->mask ? &gif->mask[i] : NULL, w);
+    STATS(gif->stats.pixels += (uint64_t) w * h;)
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+}
+
+/* Draw rows [first, last) of the current frame, in the order they are
+ * stored, onto the canvas, and add them to the damaged area. */
+static void
+render_rows(gd_GIF *gif, int first, int last, int interlace)
+{
+    int i, r, y, w, h;
+    gd_Rect row;
+    Blit blit;
+
+    frame_clip(gif, &w, &h);
+    if (!w || !h)
+        return;
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    build_lut(gif);
+    blit = select_blit(gif->compact, gif->gce.transparency, !!gif->mask);
+    for (r = first; r < last; r++) {
+        y = interlace ? interlaced_line_index((int) gif->fh, r) : r;
+        if (y >= h)
+            continue;
+        i = (gif->fy + y) * gif->width + gif->fx;
+        blit(gif->lut, &gif->frame[i], &gif->canvas[i * canvas_bpp(gif)],
+             gif->mask ? &gif->mask[i] : NULL, w);
+        STATS(gif->stats.pixels += w;)
+        row.x = gif->fx;
+        row.y = gif->fy + y;
+        row.w = w;
+        row.h = 1;
+        add_rect(&gif->damage, &row);
+    }
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+}
+
+/* Give the canvas a coverage mask, the first time a frame needs one. Until
+ * then, the canvas is either blank or fully opaque, as gif->covered says.
+ * Snapshots taken without a mask are dropped, as they no longer fit.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+add_mask(gd_GIF *gif)
+{
+    size_t n = (size_t) gif->width * gif->height, size = buffers_size(gif);
+    uint8_t *canvas;
+
+    if (gif->mask)
+        return 0;
+    canvas = realloc_mem(&gif->alloc, gif->canvas, size + n);
+    if (!canvas)
+        return fail(gif, GD_ERR_NOMEM);
+    gif->canvas = canvas;
+    gif->frame = &canvas[size - n];
+    gif->mask = &canvas[size];
+    memset(gif->mask, gif->covered ? 0xFF : 0, n);
+    if (gif->nsnaps &&
+        gd_set_snapshots(gif, gif->snap_interval, gif->snap_budget) == -1)
+        return -1;
+    return 0;
+}
+
+/* Before the current frame is drawn, add a mask unless the canvas stays
+ * fully covered without one: it already is, or the frame covers it all
+ * with opaque pixels. Frames being fed may be shown half drawn, and
+ * frames that are disposed of uncover pixels, so they always need one.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+need_mask(gd_GIF *gif)
+{
+    int w, h;
+
+    frame_clip(gif, &w, &h);
+    if (gif->mask || !w || !h)
+        return 0;
+    if (gif->gce.disposal == 2 || gif->gce.disposal == 3 ||
+        (!gif->covered && gif->push))
+        return add_mask(gif);
+    if (gif->covered)
+        return 0;
+    if (!gif->gce.transparency && w == gif->width && h == gif->height) {
+        gif->covered = 1;
+        return 0;
+    }
+    return add_mask(gif);
+}
+
+/* Save the canvas area under the current frame, to be restored by
+ * disposal method 3. The backing buffer is reused across frames.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+save_rect(gd_GIF *gif)
+{
+    int i, j, w, h, px = canvas_bpp(gif);
+    uint8_t *prev, *mask;
+    size_t size;
+
+    frame_clip(gif, &w, &h);
+    if (!w || !h)
+        return 0;
+    size = (px + 1) * (size_t) w * h;
+    if (size > gif->prev_size) {
+        prev = realloc_mem(&gif->alloc, gif->prev, size);
+        if (!prev) return fail(gif, GD_ERR_NOMEM);
+        gif->prev = prev;
+        gif->prev_size = size;
+    }
+    STATS(begin_phase(gif, GD_PHASE_DISPOSE);)
+    mask = &gif->prev[px * w * h];
+    i = gif->fy * gif->width + gif->fx;
+    for (j = 0; j < h; j++) {
+        memcpy(&gif->prev[j * w * px], &gif->canvas[i * px], w * px);
+        memcpy(&mask[j * w], &gif->mask[i], w);
+        i += gif->width;
+    }
+    STATS(end_phase(gif, GD_PHASE_DISPOSE);)
+    return 0;
 }
 
 static void
 dispose(gd_GIF *gif)
 {
-    int i, j, k;
-    uint8_t *bgcolor;
-    switch (gif->gce.disposal) {
-    case 2: /* Restore to background color. */
-        bgcolor = &gif->palette->colors[gif->bgindex*3];
-        i = gif->fy * gif->width + gif->fx;
-        for (j = 0; j < gif->fh; j++) {
-            for (k = 0; k < gif->fw; k++)
-                memcpy(&gif->canvas[(i+k)*3], bgcolor, 3);
-            i += gif->width;
+    int i, j, k, w, h, px = canvas_bpp(gif);
+    uint8_t *bgcolor, *row;
+
+    frame_clip(gif, &w, &h);
+    i = gif->fy * gif->width + gif->fx;
+    row = &gif->canvas[i * px];
+    switch (gif->gce.disposal) {
+    case 2: /* Restore to background color. */
+        if (!w || !h)
+            break;
+        if (gif->compact)
+            bgcolor = &gif->bgindex;
+        else
+            bgcolor = &gif->palette->colors[gif->bgindex*3];
+        /* Fill the first row by doubling, then copy it down. */
+        memcpy(row, bgcolor, px);
+        for (k = px; k < w * px; k *= 2)
+            memcpy(&row[k], row, MIN(k, w * px - k));
+        for (j = 1; j < h; j++)
+            memcpy(&row[j * gif->width * px], row, w * px);
+        /* The background shows through. Compact canvases mark it with 1,
+         * to tell it from pixels never painted, which are black. */
+        for (j = 0; j < h; j++)
+            memset(&gif->mask[i + j * gif->width], gif->compact, w);
+        break;
+    case 3: /* Restore to previous. */
+        if (!w || !h)
+            break;
+        for (j = 0; j < h; j++) {
+            memcpy(&row[j * gif->width * px], &gif->prev[j * w * px], w * px);
+            memcpy(&gif->mask[i + j * gif->width], &gif->prev[px * w * h + j * w], w);
+        }
+        break;
+    }
+}
+
+/* Tell whether the canvas is larger than gif->limits allow. */
+static int
+over_canvas(gd_GIF *gif)
+{
+    return gif->limits.max_canvas &&
+           (uint64_t) gif->width * gif->height > gif->limits.max_canvas;
+}
+
+/* Allocate canvas and frame buffers, and LZW decoder. The mask comes
+ * later, if a frame needs it (see need_mask()).
+ * This is deferred until the first frame is read, so that handles only
+ * used for metadata stay small. */
+static int
+alloc_buffers(gd_GIF *gif)
+{
+    int px = canvas_bpp(gif);
+
+    if (over_canvas(gif))
+        return fail(gif, GD_ERR_LIMIT);
+    gif->mask = NULL;
+    gif->covered = 0;
+    gif->canvas = alloc_mem(&gif->alloc, buffers_size(gif));
+    gif->lzw = alloc_mem(&gif->alloc, sizeof(*gif->lzw));
+    if (!gif->canvas || !gif->lzw) {
+        free_mem(&gif->alloc, gif->canvas);
+        free_mem(&gif->alloc, gif->lzw);
+        gif->canvas = NULL;
+        gif->lzw = NULL;
+        return fail(gif, GD_ERR_NOMEM);
+    }
+    gif->frame = &gif->canvas[px * gif->width * gif->height];
+    if (gif->bgindex)
+        memset(gif->frame, gif->bgindex, gif->width * gif->height);
+    return 0;
+}
+
+/* Append f to the frame index, and tell whether it is a keyframe: one
+ * that doesn't depend on previous frames and leaves a canvas that
+ * doesn't depend on them either.
+ * Return 0 on success, or -1 on out-of-memory or past the frame limit. */
+static int
+add_frame(gd_GIF *gif, gd_Frame *f)
+{
+    gd_Frame *frames;
+    int size;
+
+    if (gif->limits.max_frames && gif->nframes >= gif->limits.max_frames)
+        return fail(gif, GD_ERR_LIMIT);
+    f->keyframe = f->fx == 0 && f->fy == 0 &&
+                  f->fw >= gif->width && f->fh >= gif->height &&
+                  !f->gce.transparency && f->gce.disposal != 3;
+    if (gif->nframes == gif->frames_size) {
+        size = gif->frames_size ? 2 * gif->frames_size : 16;
+        frames = realloc_mem(&gif->alloc, gif->frames, size * sizeof(*frames));
+        if (!frames) return fail(gif, GD_ERR_NOMEM);
+        gif->frames = frames;
+        gif->frames_size = size;
+    }
+    gif->frames[gif->nframes++] = *f;
+    return 0;
+}
+
+/* Save the current state, which is the one right before frame
+ * frame_no + 1 at offset, unless it's already saved or that frame is a
+ * keyframe. The least recently used slot is reused. */
+static void
+take_snapshot(gd_GIF *gif, off_t offset)
+{
+    struct gd_Snapshot *snap = NULL;
+    int i, n = gif->frame_no + 1;
+
+    if (n == 0 || (n < gif->nframes && gif->frames[n].keyframe) ||
+        gif->tainted)
+        return;
+    for (i = 0; i < gif->nsnaps; i++) {
+        if (gif->snaps[i].frame_no == gif->frame_no)
+            return;
+        if (!snap || gif->snaps[i].stamp < snap->stamp)
+            snap = &gif->snaps[i];
+    }
+    if (!snap)
+        return;
+    if (!snap->data) {
+        snap->data = alloc_mem(&gif->alloc, buffers_size(gif));
+        if (!snap->data) return;
+    }
+    memcpy(snap->data, gif->canvas, buffers_size(gif));
+    snap->covered = gif->covered;
+    snap->frame_no = gif->frame_no;
+    snap->offset = offset;
+    snap->stamp = ++gif->snap_clock;
+}
+
+/* Keep a snapshot of the canvas every interval frames, using up to budget
+ * bytes. An interval or budget of 0 disables the cache.
+ * Return the number of snapshots that fit, or -1 on out-of-memory. */
+int
+gd_set_snapshots(gd_GIF *gif, int interval, size_t budget)
+{
+    size_t size = buffers_size(gif);
+    int i, n;
+
+    for (i = 0; i < gif->nsnaps; i++)
+        free_mem(&gif->alloc, gif->snaps[i].data);
+    free_mem(&gif->alloc, gif->snaps);
+    gif->snaps = NULL;
+    gif->nsnaps = 0;
+    gif->snap_interval = 0;
+    n = interval > 0 ? MIN(budget / size, INT_MAX) : 0;
+    if (!n)
+        return 0;
+    gif->snaps = alloc_mem(&gif->alloc, n * sizeof(*gif->snaps));
+    if (!gif->snaps)
+        return fail(gif, GD_ERR_NOMEM);
+    for (i = 0; i < n; i++)
+        gif->snaps[i].frame_no = -1;
+    gif->nsnaps = n;
+    gif->snap_interval = interval;
+    gif->snap_budget = budget;
+    return n;
+}
+
+/* Check the frame just described against gif->limits, before decoding
+ * it, and count its pixels.
+ * Return 0 if it is within them, or -1. */
+static int
+admit_frame(gd_GIF *gif)
+{
+    gd_Limits *l = &gif->limits;
+    uint64_t npix = (uint64_t) gif->fw * gif->fh;
+
+    if ((l->max_frames && gif->frame_no + 1 >= l->max_frames) ||
+        (l->max_pixels && gif->decoded + npix > l->max_pixels) ||
+        (l->max_bytes && tell(gif) > l->max_bytes))
+        return fail(gif, GD_ERR_LIMIT);
+    gif->decoded += npix;
+    return 0;
+}
+
+/* Read blocks up to the next image, and decode it into gif->frame.
+ * Return 1 if got an image; 0 if got GIF trailer; -1 if error. */
+static int
+read_next_image(gd_GIF *gif)
+{
+    int interlace = -1;
+    char sep;
+
+    STATS(begin_phase(gif, GD_PHASE_PARSE);)
+    sep = read_byte(gif);
+    while (sep == '!') {
+        read_ext(gif);
+        sep = read_byte(gif);
+    }
+    if (sep == ',')
+        interlace = read_image_desc(gif);
+    STATS(end_phase(gif, GD_PHASE_PARSE);)
+    if (sep == ';')
+        return 0;
+    if (sep != ',')
+        return fail(gif, GD_ERR_FORMAT);
+    if (interlace == -1 || admit_frame(gif) == -1)
+        return -1;
+    /* Image Data. Past a byte limit, it was cut short. */
+    if (read_image_data(gif, interlace) == -1 || gif->error == GD_ERR_LIMIT)
+        return -1;
+    return 1;
+}
+
+#ifdef GD_THREADS
+/* Pipelined decoding: a thread reads and decodes images ahead, each into
+ * a slot of a single-producer, single-consumer ring, while the caller
+ * composites them. The thread works on a copy of the handle, so that the
+ * two threads share nothing but the input and the ring. */
+struct gd_Slot {
+    int ret, error; /* as from read_next_image() */
+    off_t end;
+    uint16_t fx, fy, fw, fh;
+    gd_GCE gce;
+    int lct;
+    gd_Palette palette;
+    uint16_t loop_count;
+    uint8_t *frame;
+    STATS(gd_Stats stats;) /* of reading and decoding this image */
+};
+
+struct gd_Pipe {
+    gd_GIF shadow;
+    struct gd_Slot *slots;
+    unsigned depth;
+    unsigned head, tail; /* only written by the thread and caller resp. */
+    int stop, done;
+    off_t pos; /* where the next image for the caller starts */
+    pthread_t thread;
+    pthread_mutex_t lock; /* only taken to sleep and wake up */
+    pthread_cond_t cond;
+};
+
+static void
+wake(struct gd_Pipe *p)
+{
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *
+decode_ahead(void *arg)
+{
+    struct gd_Pipe *p = arg;
+    gd_GIF *s = &p->shadow;
+    struct gd_Slot *slot;
+    unsigned head;
+    int ret, stop;
+
+    for (head = 0; ; head++) {
+        pthread_mutex_lock(&p->lock);
+        while (head - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == p->depth &&
+               !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+        slot = &p->slots[head % p->depth];
+        s->frame = slot->frame;
+        s->error = GD_OK;
+        memset(&s->gce, 0, sizeof(s->gce));
+        STATS(memset(&s->stats, 0, sizeof(s->stats));)
+        ret = read_next_image(s);
+        STATS(slot->stats = s->stats;)
+        s->frame_no += ret == 1;
+        slot->ret = ret;
+        slot->error = s->error;
+        slot->end = tell(s);
+        slot->fx = s->fx;
+        slot->fy = s->fy;
+        slot->fw = s->fw;
+        slot->fh = s->fh;
+        slot->gce = s->gce;
+        slot->lct = s->palette == &s->lct;
+        if (slot->lct)
+            slot->palette = s->lct;
+        slot->loop_count = s->loop_count;
+        __atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+        wake(p);
+        if (ret != 1)
+            break;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void
+free_pipe(gd_GIF *gif, struct gd_Pipe *p)
+{
+    unsigned i;
+
+    if (p->slots)
+        for (i = 0; i < p->depth; i++)
+            free_mem(&gif->alloc, p->slots[i].frame);
+    free_mem(&gif->alloc, p->slots);
+    free_lzw(&gif->alloc, p->shadow.lzw);
+    free_mem(&gif->alloc, p);
+}
+
+/* Start decoding ahead of the caller, from the current position.
+ * Return 0 on success or -1 on error. */
+static int
+pipeline_start(gd_GIF *gif)
+{
+    struct gd_Pipe *p;
+    gd_GIF *s;
+    unsigned i;
+
+    p = alloc_mem(&gif->alloc, sizeof(*p));
+    if (!p)
+        return fail(gif, GD_ERR_NOMEM);
+    s = &p->shadow;
+    *s = *gif;
+    p->depth = gif->pipe_depth;
+    p->slots = alloc_mem(&gif->alloc, p->depth * sizeof(*p->slots));
+    s->lzw = alloc_mem(&gif->alloc, sizeof(*s->lzw));
+    if (!p->slots || !s->lzw)
+        goto fail;
+    for (i = 0; i < p->depth; i++) {
+        p->slots[i].frame = alloc_mem(&gif->alloc, gif->width * gif->height);
+        if (!p->slots[i].frame)
+            goto fail;
+    }
+    /* The thread only reads and decodes. */
+    s->canvas = s->mask = NULL;
+    s->compact = 0;
+    s->pipe = NULL;
+    p->pos = tell(gif);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, decode_ahead, p)) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        goto fail;
+    }
+    gif->pipe = p;
+    return 0;
+fail:
+    free_pipe(gif, p);
+    return fail(gif, GD_ERR_NOMEM);
+}
+
+/* Stop the thread, and take the input back at the first image the caller
+ * hasn't got yet. */
+static void
+pipeline_stop(gd_GIF *gif)
+{
+    struct gd_Pipe *p = gif->pipe;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    gif->buf = p->shadow.buf;
+    gif->buf_pos = p->shadow.buf_pos;
+    gif->buf_len = p->shadow.buf_len;
+    gif->buf_off = p->shadow.buf_off;
+    gif->pipe = NULL;
+    seek(gif, p->pos);
+    free_pipe(gif, p);
+}
+
+/* Get the next image from the ring, like read_next_image(). */
+static int
+take_image(gd_GIF *gif)
+{
+    struct gd_Pipe *p = gif->pipe;
+    struct gd_Slot *slot;
+    int i, j, w, h, ret;
+
+    if (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail) {
+        pthread_mutex_lock(&p->lock);
+        while (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail &&
+               !p->done)
+            pthread_cond_wait(&p->cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+        if (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail)
+            return fail(gif, GD_ERR_FORMAT); /* read past the end */
+    }
+    slot = &p->slots[p->tail % p->depth];
+    ret = slot->ret;
+    STATS(add_stats(&gif->stats, &slot->stats);)
+    gif->error = ret == -1 ? slot->error : gif->error;
+    gif->fx = slot->fx;
+    gif->fy = slot->fy;
+    gif->fw = slot->fw;
+    gif->fh = slot->fh;
+    gif->gce = slot->gce;
+    gif->loop_count = slot->loop_count;
+    if (ret == 1 && slot->lct) {
+        gif->lct = slot->palette;
+        gif->palette = &gif->lct;
+        gif->lut_key = -1;
+        if (gif->compact && expand_canvas(gif) == -1)
+            ret = -1;
+    } else {
+        gif->palette = &gif->gct;
+    }
+    if (ret == 1) {
+        gif->decoded += (uint64_t) gif->fw * gif->fh;
+        frame_clip(gif, &w, &h);
+        i = gif->fy * gif->width + gif->fx;
+        for (j = 0; j < h; j++, i += gif->width)
+            memcpy(&gif->frame[i], &slot->frame[i], w);
+    }
+    p->pos = slot->end;
+    __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+    wake(p);
+    return ret;
+}
+#else
+static void
+pipeline_stop(gd_GIF *gif)
+{
+    (void) gif;
+}
+#endif
+
+/* Offset of the next image the caller will get. */
+static off_t
+input_pos(gd_GIF *gif)
+{
+#ifdef GD_THREADS
+    if (gif->pipe)
+        return gif->pipe->pos;
+#endif
+    return tell(gif);
+}
+
+/* Decode large frames on up to nthreads threads.
+ * Return 0 on success or -1 if threads aren't available. */
+int
+gd_set_decode_threads(gd_GIF *gif, int nthreads)
+{
+#ifdef GD_THREADS
+    gif->decode_threads = MAX(nthreads, 1);
+    return 0;
+#else
+    (void) gif;
+    (void) nthreads;
+    return -1;
+#endif
+}
+
+/* Decode frames on a separate thread, up to depth frames ahead of the
+ * caller, from the next call to gd_get_frame() on. A depth of 0 turns
+ * this off. Return 0 on success or -1 if threads aren't available. */
+int
+gd_set_pipeline(gd_GIF *gif, int depth)
+{
+#ifdef GD_THREADS
+    pipeline_stop(gif);
+    gif->pipe_depth = MAX(depth, 0);
+    return 0;
+#else
+    (void) gif;
+    (void) depth;
+    return -1;
+#endif
+}
+
+/* Set what gif may use from now on. The pixels of the frames decoded so
+ * far count against the new limits too.
+ * Return 0 on success or -1 if the canvas is already over the limit. */
+int
+gd_set_limits(gd_GIF *gif, const gd_Limits *limits)
+{
+    pipeline_stop(gif);
+    gif->limits = *limits;
+    if (gif->error == GD_ERR_LIMIT)
+        gif->error = GD_OK;
+    if (gif->mem_size) {
+        /* Data in memory is all in the input buffer. */
+        gif->buf_len = gif->mem_size;
+        if (limits->max_bytes)
+            gif->buf_len = MIN(gif->buf_len, (size_t) limits->max_bytes);
+        gif->buf_pos = MIN(gif->buf_pos, gif->buf_len);
+    }
+    if (over_canvas(gif))
+        return fail(gif, GD_ERR_LIMIT);
+    return 0;
+}
+
+/* Dispose of the current frame, before reading the blocks of the next
+ * one. */
+static void
+end_frame(gd_GIF *gif)
+{
+    memset(&gif->damage, 0, sizeof(gif->damage));
+    if (gif->frame_no == -1) {
+        /* The canvas was just cleared, maybe over an older one. */
+        gif->damage.w = gif->width;
+        gif->damage.h = gif->height;
+    } else if (gif->gce.disposal == 2 || gif->gce.disposal == 3) {
+        frame_rect(gif, &gif->damage);
+    }
+    STATS(begin_phase(gif, GD_PHASE_DISPOSE);)
+    dispose(gif);
+    STATS(end_phase(gif, GD_PHASE_DISPOSE);)
+    /* A GCE only applies to the image that follows it. */
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    gif->ended = 0;
+}
+
+/* Count the frame just read, which starts at offset start, adding it to
+ * the index the first time, where the index then ends at offset end.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+count_frame(gd_GIF *gif, off_t start, off_t end)
+{
+    gd_Frame f;
+
+    gif->frame_no++;
+    if (gif->frame_no < gif->nframes)
+        return 0;
+    f.offset = start;
+    f.fx = gif->fx;
+    f.fy = gif->fy;
+    f.fw = gif->fw;
+    f.fh = gif->fh;
+    f.gce = gif->gce;
+    f.lct = gif->palette == &gif->lct;
+    if (add_frame(gif, &f) == -1)
+        return -1;
+    gif->index_end = end;
+    return 0;
+}
+
+/* Shared cache. Entries are keyed by where their data comes from: the
+ * device, inode, size and modification time of a regular file, or the
+ * size and a hash of data in memory. Each entry holds the frame index of
+ * its source and, for handles that share them, composited frames. */
+typedef struct CacheKey {
+    uint64_t kind, dev, ino, size, mtime;
+} CacheKey;
+
+/* The canvas, frame and mask buffers right after a frame was drawn. */
+typedef struct CachedFrame {
+    gd_Frame f;  /* f.offset is where the frame starts */
+    off_t end;   /* and end where it ends */
+    gd_Palette lct;
+    int bpp;     /* canvas_bpp() of data */
+    int covered; /* gif->covered, if data has no mask */
+    size_t size; /* with a mask, more than bpp + 1 bytes per pixel */
+    unsigned stamp; /* last use, for LRU eviction */
+    uint8_t *data;
+} CachedFrame;
+
+struct gd_CacheEntry {
+    CacheKey key;
+    int users; /* handles attached, which keep the entry alive */
+    unsigned stamp;
+    gd_Frame *frames;
+    int nframes, indexed;
+    off_t index_end;
+    uint16_t loop_count;
+    CachedFrame **cached; /* by frame number, NULL if not cached */
+    int ncached;
+    struct gd_CacheEntry *next;
+};
+
+struct gd_Cache {
+    gd_Allocator alloc;
+    size_t budget, used;
+    unsigned clock;
+    struct gd_CacheEntry *entries;
+#ifdef GD_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+static void
+lock_cache(gd_Cache *c)
+{
+#ifdef GD_THREADS
+    pthread_mutex_lock(&c->lock);
+#else
+    (void) c;
+#endif
+}
+
+static void
+unlock_cache(gd_Cache *c)
+{
+#ifdef GD_THREADS
+    pthread_mutex_unlock(&c->lock);
+#else
+    (void) c;
+#endif
+}
+
+/* Store in key where the data of gif comes from.
+ * Return 0 on success or -1 if that can't be told. */
+static int
+source_key(gd_GIF *gif, CacheKey *key)
+{
+    struct stat st;
+    uint64_t h = 0xCBF29CE484222325;
+    size_t i;
+
+    memset(key, 0, sizeof(*key));
+    if (gif->fd != -1) {
+        if (fstat(gif->fd, &st) == -1 || !S_ISREG(st.st_mode))
+            return -1;
+        key->kind = 1;
+        key->dev = st.st_dev;
+        key->ino = st.st_ino;
+        key->size = st.st_size;
+        key->mtime = st.st_mtime;
+        return 0;
+    }
+    if (!gif->mem_size)
+        return -1;
+    /* FNV-1a. */
+    for (i = 0; i < gif->mem_size; i++)
+        h = (h ^ gif->buf[i]) * 0x100000001B3;
+    key->kind = 2;
+    key->ino = h;
+    key->size = gif->mem_size;
+    return 0;
+}
+
+static void
+free_cached(gd_Cache *c, CachedFrame *cf)
+{
+    c->used -= sizeof(*cf) + cf->size;
+    free_mem(&c->alloc, cf->data);
+    free_mem(&c->alloc, cf);
+}
+
+static void
+free_entry(gd_Cache *c, struct gd_CacheEntry *e)
+{
+    int i;
+
+    for (i = 0; i < e->ncached; i++)
+        if (e->cached[i])
+            free_cached(c, e->cached[i]);
+    c->used -= sizeof(*e) + e->nframes * sizeof(*e->frames) +
+               e->ncached * sizeof(*e->cached);
+    free_mem(&c->alloc, e->cached);
+    free_mem(&c->alloc, e->frames);
+    free_mem(&c->alloc, e);
+}
+
+/* Evict the least recently used frames, then entries no handle uses,
+ * until size more bytes fit in the budget.
+ * Return 0 if they do, or -1 if they can't. */
+static int
+make_room(gd_Cache *c, size_t size)
+{
+    struct gd_CacheEntry *e, **pe, **lru_entry;
+    CachedFrame **lru;
+    int i;
+
+    while (c->used + size > c->budget) {
+        lru = NULL;
+        for (e = c->entries; e; e = e->next)
+            for (i = 0; i < e->ncached; i++)
+                if (e->cached[i] &&
+                    (!lru || e->cached[i]->stamp < (*lru)->stamp))
+                    lru = &e->cached[i];
+        if (lru) {
+            free_cached(c, *lru);
+            *lru = NULL;
+            continue;
+        }
+        lru_entry = NULL;
+        for (pe = &c->entries; *pe; pe = &(*pe)->next)
+            if (!(*pe)->users &&
+                (!lru_entry || (*pe)->stamp < (*lru_entry)->stamp))
+                lru_entry = pe;
+        if (!lru_entry)
+            return -1;
+        e = *lru_entry;
+        *lru_entry = e->next;
+        free_entry(c, e);
+    }
+    return 0;
+}
+
+/* Share the frame index of gif through its cache, if it knows more. */
+static void
+publish_index(gd_GIF *gif)
+{
+    struct gd_CacheEntry *e = gif->cache_entry;
+    gd_Cache *c = gif->cache;
+    size_t size = gif->nframes * sizeof(*gif->frames);
+    gd_Frame *frames;
+
+    if (!e)
+        return;
+    lock_cache(c);
+    if ((gif->nframes > e->nframes ||
+         (gif->nframes == e->nframes && gif->indexed && !e->indexed)) &&
+        make_room(c, size - e->nframes * sizeof(*e->frames)) == 0 &&
+        (frames = alloc_mem(&c->alloc, size))) {
+        memcpy(frames, gif->frames, size);
+        c->used += size - e->nframes * sizeof(*e->frames);
+        free_mem(&c->alloc, e->frames);
+        e->frames = frames;
+        e->nframes = gif->nframes;
+        e->indexed = gif->indexed;
+        e->index_end = gif->index_end;
+        e->loop_count = gif->loop_count;
+    }
+    unlock_cache(c);
+}
+
+/* Share frame gif->frame_no, just drawn, through the cache, unless it is
+ * already there. Frames disposed of by restoring what was under them are
+ * left out, since that takes more than their own buffers, and so is a
+ * canvas that may still hold part of a frame that failed to decode. */
+static void
+store_frame(gd_GIF *gif, off_t start, off_t end)
+{
+    struct gd_CacheEntry *e = gif->cache_entry;
+    gd_Cache *c = gif->cache;
+    CachedFrame *cf, **cached;
+    size_t size = buffers_size(gif);
+    int n = gif->frame_no, ncached;
+
+    if (!gif->cache_frames || gif->gce.disposal == 3 || gif->tainted)
+        return;
+    lock_cache(c);
+    if (n >= e->ncached) {
+        ncached = MAX(n + 1, 2 * e->ncached);
+        if (make_room(c, (ncached - e->ncached) * sizeof(*cached)) == -1)
+            goto done;
+        cached = realloc_mem(&c->alloc, e->cached, ncached * sizeof(*cached));
+        if (!cached)
+            goto done;
+        memset(&cached[e->ncached], 0,
+               (ncached - e->ncached) * sizeof(*cached));
+        c->used += (ncached - e->ncached) * sizeof(*cached);
+        e->cached = cached;
+        e->ncached = ncached;
+    }
+    if (e->cached[n] || make_room(c, sizeof(*cf) + size) == -1)
+        goto done;
+    cf = alloc_mem(&c->alloc, sizeof(*cf));
+    if (cf)
+        cf->data = alloc_mem(&c->alloc, size);
+    if (!cf || !cf->data) {
+        free_mem(&c->alloc, cf);
+        goto done;
+    }
+    memcpy(cf->data, gif->canvas, size);
+    cf->f.offset = start;
+    cf->f.fx = gif->fx;
+    cf->f.fy = gif->fy;
+    cf->f.fw = gif->fw;
+    cf->f.fh = gif->fh;
+    cf->f.gce = gif->gce;
+    cf->f.lct = gif->palette == &gif->lct;
+    if (cf->f.lct)
+        cf->lct = gif->lct;
+    cf->end = end;
+    cf->bpp = canvas_bpp(gif);
+    cf->covered = gif->covered;
+    cf->size = size;
+    cf->stamp = ++c->clock;
+    c->used += sizeof(*cf) + size;
+    e->cached[n] = cf;
+done:
+    unlock_cache(c);
+}
+
+/* Make frame n current from the cache, if it is there with the same kind
+ * of canvas, as if it had just been decoded.
+ * Return 1 if it was, 0 if not, or -1 on out-of-memory. */
+static int
+load_frame(gd_GIF *gif, int n)
+{
+    struct gd_CacheEntry *e = gif->cache_entry;
+    gd_Cache *c = gif->cache;
+    CachedFrame *cf;
+    off_t start = 0, end = 0;
+    gd_Rect r;
+    int ret = 0;
+
+    if (!gif->cache_frames)
+        return 0;
+    lock_cache(c);
+    cf = n < e->ncached ? e->cached[n] : NULL;
+    if (cf && cf->bpp == canvas_bpp(gif)) {
+        /* What the last frame is disposed from changes too, and all of
+         * a canvas just cleared. */
+        memset(&gif->damage, 0, sizeof(gif->damage));
+        if (gif->frame_no == -1) {
+            gif->damage.w = gif->width;
+            gif->damage.h = gif->height;
+        } else if (gif->gce.disposal == 2 || gif->gce.disposal == 3) {
+            frame_rect(gif, &gif->damage);
         }
-        break;
-    case 3: /* Restore to previous, i.e., don't update canvas.*/
-        break;
-    default:
-        /* Add frame non-transparent pixels to canvas. */
-        render_frame_rect(gif, gif->canvas);
+        /* Either of them may have a mask, which the other lacks. */
+        if (cf->size > buffers_size(gif) && add_mask(gif) == -1) {
+            unlock_cache(c);
+            return -1;
+        }
+        memcpy(gif->canvas, cf->data, cf->size);
+        if (cf->size < buffers_size(gif))
+            memset(gif->mask, cf->covered ? 0xFF : 0,
+                   (size_t) gif->width * gif->height);
+        gif->covered = cf->covered;
+        gif->fx = cf->f.fx;
+        gif->fy = cf->f.fy;
+        gif->fw = cf->f.fw;
+        gif->fh = cf->f.fh;
+        gif->gce = cf->f.gce;
+        if (cf->f.lct) {
+            gif->lct = cf->lct;
+            gif->palette = &gif->lct;
+            gif->lut_key = -1;
+        } else {
+            gif->palette = &gif->gct;
+        }
+        start = cf->f.offset;
+        end = cf->end;
+        gif->ended = 0;
+        gif->tainted = 0;
+        cf->stamp = ++c->clock;
+        ret = 1;
+    }
+    unlock_cache(c);
+    if (ret != 1)
+        return ret;
+    frame_rect(gif, &r);
+    add_rect(&gif->damage, &r);
+    seek(gif, end);
+    gif->frame_no = n - 1;
+    return count_frame(gif, start, end) == -1 ? -1 : 1;
+}
+
+/* Create a cache of decoded data that handles on the same source can
+ * share, from different threads with GD_THREADS, using up to budget
+ * bytes. Return NULL on out-of-memory. */
+gd_Cache *
+gd_open_cache(size_t budget, const gd_Allocator *alloc)
+{
+    static const gd_Allocator std_alloc;
+    gd_Cache *c;
+
+    if (!alloc)
+        alloc = &std_alloc;
+    if (!valid_alloc(alloc))
+        return NULL;
+    c = alloc_mem(alloc, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->alloc = *alloc;
+    c->budget = budget;
+#ifdef GD_THREADS
+    if (pthread_mutex_init(&c->lock, NULL)) {
+        free_mem(alloc, c);
+        return NULL;
+    }
+#endif
+    return c;
+}
+
+/* Attach gif to cache, or detach it with a NULL cache. Its frame index is
+ * shared through the cache and, with frames set, so are its composited
+ * frames. Return 0 on success, or -1 if the source of gif can't be
+ * identified (a stream, or pushed data) or on out-of-memory. */
+int
+gd_set_cache(gd_GIF *gif, gd_Cache *cache, int frames)
+{
+    struct gd_CacheEntry *e;
+    gd_Frame *index;
+    CacheKey key;
+
+    if (gif->cache) {
+        publish_index(gif);
+        lock_cache(gif->cache);
+        gif->cache_entry->users--;
+        unlock_cache(gif->cache);
+        gif->cache = NULL;
+        gif->cache_entry = NULL;
+        gif->cache_frames = 0;
+    }
+    if (!cache)
+        return 0;
+    if (gif->push || source_key(gif, &key) == -1)
+        return -1;
+    lock_cache(cache);
+    for (e = cache->entries; e; e = e->next)
+        if (!memcmp(&e->key, &key, sizeof(key)))
+            break;
+    if (!e) {
+        e = alloc_mem(&cache->alloc, sizeof(*e));
+        if (!e) {
+            unlock_cache(cache);
+            return fail(gif, GD_ERR_NOMEM);
+        }
+        e->key = key;
+        e->next = cache->entries;
+        cache->entries = e;
+        cache->used += sizeof(*e);
+    }
+    e->users++;
+    e->stamp = ++cache->clock;
+    /* Take the index over if it's longer. */
+    if (e->nframes > gif->nframes &&
+        (index = realloc_mem(&gif->alloc, gif->frames,
+                             e->nframes * sizeof(*index)))) {
+        memcpy(index, e->frames, e->nframes * sizeof(*index));
+        gif->frames = index;
+        gif->nframes = gif->frames_size = e->nframes;
+        gif->indexed = e->indexed;
+        gif->index_end = e->index_end;
+        if (e->indexed)
+            gif->loop_count = e->loop_count;
+    }
+    make_room(cache, 0);
+    unlock_cache(cache);
+    gif->cache = cache;
+    gif->cache_entry = e;
+    gif->cache_frames = frames;
+    return 0;
+}
+
+/* Free cache, after all handles attached to it are closed or detached. */
+void
+gd_close_cache(gd_Cache *cache)
+{
+    struct gd_CacheEntry *e;
+
+    while ((e = cache->entries)) {
+        cache->entries = e->next;
+        free_entry(cache, e);
     }
+#ifdef GD_THREADS
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free_mem(&cache->alloc, cache);
 }
 
 /* Return 1 if got a frame; 0 if got GIF trailer; -1 if error. */
 int
 gd_get_frame(gd_GIF *gif)
 {
-    char sep;
+    off_t start;
+    gd_Rect r;
+    int n, ret;
 
-    dispose(gif);
-    read(gif->fd, &sep, 1);
-    while (sep != ',') {
-        if (sep == ';')
-            return 0;
-        if (sep == '!')
-            read_ext(gif);
-        else return -1;
-        read(gif->fd, &sep, 1);
-    }
-    if (read_image(gif) == -1)
+    if (!gif->canvas) {
+        n = gif->frame_no;
+        if (alloc_buffers(gif) == -1)
+            return -1;
+        /* After gd_trim(), decode the current frame again first. */
+        gif->frame_no = -1;
+        if (n >= 0 && gd_seek_frame(gif, n) != 1)
+            return -1;
+    }
+    /* Decoding ahead would get out of step with frames from the cache. */
+    if (!gif->pipe_depth && (ret = load_frame(gif, gif->frame_no + 1)))
+        return ret;
+#ifdef GD_THREADS
+    if (gif->pipe_depth && !gif->pipe && pipeline_start(gif) == -1)
+        return -1;
+#endif
+    end_frame(gif);
+    start = input_pos(gif);
+    if (gif->snap_interval && (gif->frame_no + 1) % gif->snap_interval == 0)
+        take_snapshot(gif, start);
+#ifdef GD_THREADS
+    if (gif->pipe)
+        ret = take_image(gif);
+    else
+#endif
+    ret = read_next_image(gif);
+    if (ret == 0) {
+        if (gif->frame_no + 1 == gif->nframes)
+            gif->indexed = 1;
+        /* The canvas no longer shows gif->frame_no, it was disposed of. */
+        gif->ended = 1;
+        publish_index(gif);
+        return 0;
+    }
+    if (ret == -1) {
+        /* Leave nothing for the next call to dispose of. The canvas may
+         * hold part of the frame until one is decoded from scratch. */
+        gif->fw = gif->fh = 0;
+        gif->tainted = 1;
+        return -1;
+    }
+    if (need_mask(gif) == -1 ||
+        (gif->gce.disposal == 3 && save_rect(gif) == -1))
+        return -1;
+    render_frame_rect(gif);
+    frame_rect(gif, &r);
+    add_rect(&gif->damage, &r);
+    if (count_frame(gif, start, input_pos(gif)) == -1)
         return -1;
+    if (gif->frames[gif->frame_no].keyframe)
+        gif->tainted = 0;
+    if (gif->cache)
+        store_frame(gif, start, input_pos(gif));
     return 1;
 }
 
+/* Open a GIF whose data is then pushed through gd_feed(). */
+gd_GIF *
+gd_open_gif_push(const gd_Allocator *alloc)
+{
+    gd_GIF *gif;
+
+    gif = new_gif(alloc, 0);
+    if (!gif)
+        return NULL;
+    /* The input buffer holds pushed data not read yet. */
+    gif->buf = NULL;
+    gif->push = PUSH_HEADER;
+    gif->frame_no = -1;
+    return gif;
+}
+
+/* Append len bytes to the input, first dropping what has been read.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+push_data(gd_GIF *gif, const void *data, size_t len)
+{
+    uint8_t *buf = (uint8_t *) gif->buf;
+    size_t left = gif->buf_len - gif->buf_pos, size;
+
+    if (gif->buf_pos) {
+        memmove(buf, &buf[gif->buf_pos], left);
+        gif->buf_off += gif->buf_pos;
+        gif->buf_pos = 0;
+        gif->buf_len = left;
+    }
+    if (left + len > gif->push_size) {
+        size = MAX(left + len, gif->push_size * 2);
+        buf = realloc_mem(&gif->alloc, buf, size);
+        if (!buf)
+            return -1;
+        gif->buf = buf;
+        gif->push_size = size;
+    }
+    memcpy(&buf[left], data, len);
+    gif->buf_len = left + len;
+    STATS(gif->stats.bytes_read += len;)
+    return 0;
+}
+
+/* Tell whether the sub-blocks from offset i of the input buffer on have
+ * all been pushed, up to their terminator. */
+static int
+sub_blocks_pushed(gd_GIF *gif, size_t i)
+{
+    while (i < gif->buf_len) {
+        if (!gif->buf[i])
+            return 1;
+        i += gif->buf[i] + 1;
+    }
+    return 0;
+}
+
+/* Tell whether the whole header, or the next block up to its image data,
+ * has been pushed. */
+static int
+block_pushed(gd_GIF *gif)
+{
+    size_t n = gif->buf_len - gif->buf_pos;
+    const uint8_t *p;
+
+    if (!n)
+        return 0;
+    p = &gif->buf[gif->buf_pos];
+    if (gif->push == PUSH_HEADER)
+        return n >= 13 &&
+               n >= 13 + (p[10] & 0x80 ? 3u << ((p[10] & 7) + 1) : 0);
+    switch (p[0]) {
+    case '!':
+        return n >= 2 && sub_blocks_pushed(gif, gif->buf_pos + 2);
+    case ',':
+        /* Image Descriptor, LCT and LZW code size. */
+        return n >= 11 &&
+               n >= 11 + (p[9] & 0x80 ? 3u << ((p[9] & 7) + 1) : 0);
+    default:
+        return 1;
+    }
+}
+
+/* Draw the rows of the frame being fed that were decoded since last
+ * time, up to row rows, from the first npix pixels. */
+static void
+draw_rows(gd_GIF *gif, Decoder *d, int rows, uint32_t npix)
+{
+    if (!d->direct)
+        map_rows(gif, d->out, d->rows, npix, d->interlace);
+    render_rows(gif, d->rows, rows, d->interlace);
+    d->rows = rows;
+    gif->feed_rows = rows;
+}
+
+static int
+push_fail(gd_GIF *gif, int error)
+{
+    gif->push = PUSH_FAILED;
+    return fail(gif, error);
+}
+
+/* Push len more bytes of input, from a handle opened with
+ * gd_open_gif_push(), and decode as much as possible. The canvas is drawn
+ * as rows come in, and gif->damage covers what changed during the call.
+ * Return GD_FEED_FRAME when a frame is complete, in which case the rest
+ * of the data is used by the next call, GD_FEED_MORE when more data is
+ * needed, GD_FEED_END after the trailer, or -1 on error. */
+int
+gd_feed(gd_GIF *gif, const void *data, size_t len)
+{
+    Decoder *d;
+    int interlace = -1, error, done;
+    char sep;
+
+    if (gif->push == PUSH_NONE || gif->push == PUSH_FAILED)
+        return -1;
+    if (len && push_data(gif, data, len) == -1)
+        return push_fail(gif, GD_ERR_NOMEM);
+    if (gif->limits.max_bytes &&
+        gif->buf_off + (off_t) gif->buf_len > gif->limits.max_bytes)
+        return push_fail(gif, GD_ERR_LIMIT);
+    memset(&gif->damage, 0, sizeof(gif->damage));
+    while (1) {
+        switch (gif->push) {
+        case PUSH_HEADER:
+            if (!block_pushed(gif))
+                return GD_FEED_MORE;
+            error = read_header(gif);
+            if (error != GD_OK)
+                return push_fail(gif, error);
+            gif->push = PUSH_NEXT;
+            break;
+        case PUSH_NEXT:
+        case PUSH_BLOCKS:
+            if (!block_pushed(gif))
+                return GD_FEED_MORE;
+            if (gif->push == PUSH_NEXT) {
+                if (!gif->canvas && alloc_buffers(gif) == -1)
+                    return push_fail(gif, gif->error);
+                end_frame(gif);
+                gif->lzw->push_start = tell(gif);
+                gif->push = PUSH_BLOCKS;
+            }
+            STATS(begin_phase(gif, GD_PHASE_PARSE);)
+            sep = read_byte(gif);
+            if (sep == '!')
+                read_ext(gif);
+            else if (sep == ',')
+                interlace = read_image_desc(gif);
+            STATS(end_phase(gif, GD_PHASE_PARSE);)
+            if (sep == ';') {
+                if (gif->frame_no + 1 == gif->nframes)
+                    gif->indexed = 1;
+                gif->push = PUSH_END;
+                return GD_FEED_END;
+            }
+            if (sep == '!')
+                break;
+            if (sep != ',')
+                return push_fail(gif, GD_ERR_FORMAT);
+            if (interlace == -1 || admit_frame(gif) == -1 ||
+                need_mask(gif) == -1 ||
+                (gif->gce.disposal == 3 && save_rect(gif) == -1) ||
+                start_image_data(gif, &gif->lzw->push, interlace) == -1) {
+                gif->fw = gif->fh = 0;
+                return push_fail(gif, gif->error);
+            }
+            gif->feed_rows = 0;
+            gif->push = PUSH_IMAGE;
+            break;
+        case PUSH_IMAGE:
+            d = &gif->lzw->push;
+            STATS(begin_phase(gif, GD_PHASE_DECODE);)
+            done = decode_keys(gif, d, UINT32_MAX);
+            STATS(end_phase(gif, GD_PHASE_DECODE);)
+            if (!done) {
+                if (gif->fw)
+                    draw_rows(gif, d, MIN(d->pos / gif->fw, gif->fh),
+                              d->pos - d->pos % gif->fw);
+                return GD_FEED_MORE;
+            }
+            draw_rows(gif, d, gif->fh, d->pos);
+            /* The rest of the current sub-block is there already. */
+            if (!d->bits.end)
+                skip(gif, d->bits.sub_len);
+            if (count_frame(gif, gif->lzw->push_start, tell(gif)) == -1)
+                return push_fail(gif, gif->error);
+            gif->push = d->bits.end ? PUSH_NEXT : PUSH_TAIL;
+            return GD_FEED_FRAME;
+        case PUSH_TAIL:
+            if (!sub_blocks_pushed(gif, gif->buf_pos))
+                return GD_FEED_MORE;
+            discard_sub_blocks(gif);
+            gif->push = PUSH_NEXT;
+            break;
+        default:
+            return GD_FEED_END;
+        }
+    }
+}
+
+static int
+format_size(int format)
+{
+    switch (format) {
+    case GD_RGB: return 3;
+    case GD_RGB565: return 2;
+    case GD_INDEXED: return 1;
+    default: return 4;
+    }
+}
+
+/* Convert n RGB pixels with coverage mask into format. */
+static void
+convert_row(const uint8_t *rgb, const uint8_t *mask, uint8_t *dst, int n,
+            int format)
+{
+    uint16_t c;
+    uint8_t a;
+
+    switch (format) {
+    case GD_RGB:
+        memcpy(dst, rgb, n * 3);
+        break;
+    case GD_RGBA:
+    case GD_BGRA:
+    case GD_RGBA_PREMUL:
+    case GD_BGRA_PREMUL:
+        for (; n > 0; n--, rgb += 3, mask++, dst += 4) {
+            a = *mask;
+            /* Alpha is either 0 or 255, so premultiplying is masking. */
+            if ((format == GD_RGBA_PREMUL || format == GD_BGRA_PREMUL) && !a) {
+                memset(dst, 0, 4);
+                continue;
+            }
+            if (format == GD_RGBA || format == GD_RGBA_PREMUL) {
+                dst[0] = rgb[0]; dst[1] = rgb[1]; dst[2] = rgb[2];
+            } else {
+                dst[0] = rgb[2]; dst[1] = rgb[1]; dst[2] = rgb[0];
+            }
+            dst[3] = a;
+        }
+        break;
+    case GD_RGB565:
+        for (; n > 0; n--, rgb += 3, dst += 2) {
+            c = (uint16_t) ((rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3);
+            /* Rows need not be aligned. */
+            memcpy(dst, &c, 2);
+        }
+        break;
+    }
+}
+
+/* Coverage of canvas pixel i: 0xFF if opaque, 0 if never painted, or 1
+ * for the background showing through in compact mode. */
+static uint8_t
+coverage(gd_GIF *gif, int i)
+{
+    if (!gif->mask)
+        return gif->covered ? 0xFF : 0;
+    return gif->mask[i];
+}
+
+/* Convert n canvas pixels, starting at pixel i, into format. */
+static void
+render_row(gd_GIF *gif, int i, uint8_t *dst, int n, int format)
+{
+    static const uint8_t black[3];
+    uint8_t rgb[0x100 * 3], mask[0x100], a;
+    const uint8_t *c;
+    int k, m;
+
+    if (format == GD_INDEXED) {
+        memcpy(dst, &gif->frame[i], n);
+        return;
+    }
+    if (!gif->compact && gif->mask) {
+        convert_row(&gif->canvas[i * 3], &gif->mask[i], dst, n, format);
+        return;
+    }
+    /* Expand indices through the GCT, or the mask of a canvas without
+     * one, a chunk at a time. */
+    if (!gif->mask)
+        memset(mask, coverage(gif, i), sizeof(mask));
+    for (; n > 0; n -= m, i += m, dst += m * format_size(format)) {
+        m = MIN(n, 0x100);
+        if (!gif->compact) {
+            convert_row(&gif->canvas[i * 3], mask, dst, m, format);
+            continue;
+        }
+        for (k = 0; k < m; k++) {
+            a = coverage(gif, i + k);
+            c = a ? &gif->gct.colors[gif->canvas[i+k] * 3] : black;
+            memcpy(&rgb[k*3], c, 3);
+            mask[k] = a == 0xFF ? 0xFF : 0;
+        }
+        convert_row(rgb, mask, dst, m, format);
+    }
+}
+
+/* Write the canvas into buffer, in the given pixel format, with rows
+ * stride bytes apart. */
+void
+gd_render_frame_fmt(gd_GIF *gif, void *buffer, int stride, int format)
+{
+    uint8_t *dst = buffer;
+    int j;
+
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    for (j = 0; j < gif->height; j++, dst += stride) {
+        if (!gif->canvas) {
+            /* No frame read yet. */
+            memset(dst, 0, gif->width * format_size(format));
+            continue;
+        }
+        render_row(gif, j * gif->width, dst, gif->width, format);
+    }
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+}
+
+/* Update buffer, as last written by gd_render_frame_fmt() or by this
+ * function with the same format, only where the canvas changed. */
+void
+gd_render_damage(gd_GIF *gif, void *buffer, int stride, int format)
+{
+    gd_Rect *r = &gif->damage;
+    uint8_t *dst;
+    int j;
+
+    if (!gif->canvas)
+        return;
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    dst = (uint8_t *) buffer + r->y * stride + r->x * format_size(format);
+    for (j = 0; j < r->h; j++, dst += stride)
+        render_row(gif, (r->y + j) * gif->width + r->x, dst, r->w, format);
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+}
+
+/* Write the canvas into buffer, scaled to width by height pixels, with
+ * rows stride bytes apart. Each output pixel is the average of the box of
+ * canvas pixels it covers, or the nearest one when scaling up or with
+ * GD_INDEXED. Colors are averaged over opaque pixels only, except for
+ * GD_RGB and GD_RGB565, which show transparent pixels as they are. */
+void
+gd_render_scaled(gd_GIF *gif, void *buffer, int stride, int format,
+                 int width, int height)
+{
+    static const uint8_t black[3];
+    uint64_t all[3], opaque[3], n, nop; /* a box may span the canvas */
+    int x, y, x0, x1, y0, y1, i, j, k, px = format_size(format);
+    uint8_t *dst, rgb[3], a;
+    const uint8_t *c;
+
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    for (y = 0; y < height; y++) {
+        dst = (uint8_t *) buffer + y * stride;
+        if (!gif->canvas) {
+            memset(dst, 0, width * px);
+            continue;
+        }
+        y0 = (int) ((uint64_t) y * gif->height / height);
+        y1 = MAX((int) ((uint64_t) (y + 1) * gif->height / height), y0 + 1);
+        for (x = 0; x < width; x++, dst += px) {
+            x0 = (int) ((uint64_t) x * gif->width / width);
+            x1 = MAX((int) ((uint64_t) (x + 1) * gif->width / width), x0 + 1);
+            if (format == GD_INDEXED) {
+                *dst = gif->frame[y0 * gif->width + x0];
+                continue;
+            }
+            memset(all, 0, sizeof(all));
+            memset(opaque, 0, sizeof(opaque));
+            nop = 0;
+            for (j = y0; j < y1; j++) {
+                i = j * gif->width + x0;
+                for (; i < j * gif->width + x1; i++) {
+                    a = coverage(gif, i);
+                    if (!gif->compact)
+                        c = &gif->canvas[i * 3];
+                    else if (a)
+                        c = &gif->gct.colors[gif->canvas[i] * 3];
+                    else
+                        c = black;
+                    for (k = 0; k < 3; k++)
+                        all[k] += c[k];
+                    if (a == 0xFF) {
+                        for (k = 0; k < 3; k++)
+                            opaque[k] += c[k];
+                        nop++;
+                    }
+                }
+            }
+            n = (uint64_t) (x1 - x0) * (y1 - y0);
+            for (k = 0; k < 3; k++) {
+                if (format == GD_RGBA_PREMUL || format == GD_BGRA_PREMUL)
+                    rgb[k] = (opaque[k] + n / 2) / n;
+                else if (nop && format != GD_RGB && format != GD_RGB565)
+                    rgb[k] = (opaque[k] + nop / 2) / nop;
+                else
+                    rgb[k] = (all[k] + n / 2) / n;
+            }
+            a = (255 * nop + n / 2) / n;
+            convert_row(rgb, &a, dst, 1, format);
+        }
+    }
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+}
+
+/* Decode the first frame straight into buffer, as gd_render_frame_fmt()
+ * would write it after the first gd_get_frame(), without allocating the
+ * canvas. Only works before any frame is read. The handle is then left as
+ * if trimmed at frame 0 (see gd_trim()), and reading stops right after
+ * the frame.
+ * Return 1 if got a frame; 0 if got GIF trailer; -1 if error. */
+int
+gd_decode_first_frame(gd_GIF *gif, void *buffer, int stride, int format)
+{
+    uint8_t rgb[0x100 * 3], mask[0x100], *dst = buffer;
+    int i, j, m, x0, x1, w, h, ret, compact, px = format_size(format);
+    off_t start;
+    Blit blit;
+
+    if (gif->canvas || gif->frame_no != -1)
+        return -1;
+    if (over_canvas(gif))
+        return fail(gif, GD_ERR_LIMIT);
+    gif->lzw = alloc_mem(&gif->alloc, sizeof(*gif->lzw));
+    gif->frame = alloc_mem(&gif->alloc, gif->width * gif->height);
+    if (!gif->lzw || !gif->frame) {
+        ret = fail(gif, GD_ERR_NOMEM);
+        goto done;
+    }
+    if (gif->bgindex)
+        memset(gif->frame, gif->bgindex, gif->width * gif->height);
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    start = tell(gif);
+    /* There is no canvas to convert yet. */
+    compact = gif->compact;
+    gif->compact = 0;
+    ret = read_next_image(gif);
+    gif->compact = compact;
+    if (ret == 0 && !gif->nframes)
+        gif->indexed = 1;
+    if (ret != 1) {
+        gif->fw = gif->fh = 0;
+        goto done;
+    }
+    STATS(begin_phase(gif, GD_PHASE_RENDER);)
+    build_lut(gif);
+    blit = select_blit(0, gif->gce.transparency, 1);
+    frame_clip(gif, &w, &h);
+    STATS(gif->stats.pixels += (uint64_t) w * h;)
+    for (j = 0; j < gif->height; j++, dst += stride) {
+        if (format == GD_INDEXED) {
+            memcpy(dst, &gif->frame[j * gif->width], gif->width);
+            continue;
+        }
+        /* Draw the frame over a blank row, a chunk at a time. */
+        for (i = 0; i < gif->width; i += m) {
+            m = MIN(gif->width - i, 0x100);
+            memset(rgb, 0, m * 3);
+            memset(mask, 0, m);
+            x0 = MAX(i, gif->fx);
+            x1 = MIN(i + m, gif->fx + w);
+            if (j >= gif->fy && j < gif->fy + h && x0 < x1)
+                blit(gif->lut, &gif->frame[j * gif->width + x0],
+                     &rgb[(x0 - i) * 3], &mask[x0 - i], x1 - x0);
+            convert_row(rgb, mask, &dst[i * px], m, format);
+        }
+    }
+    STATS(end_phase(gif, GD_PHASE_RENDER);)
+    if (count_frame(gif, start, tell(gif)) == -1)
+        ret = -1;
+done:
+    free_lzw(&gif->alloc, gif->lzw);
+    free_mem(&gif->alloc, gif->frame);
+    gif->lzw = NULL;
+    gif->frame = NULL;
+    return ret;
+}
+
 void
 gd_render_frame(gd_GIF *gif, uint8_t *buffer)
 {
-    memcpy(buffer, gif->canvas, gif->width * gif->height * 3);
-    render_frame_rect(gif, buffer);
+    gd_render_frame_fmt(gif, buffer, gif->width * 3, GD_RGB);
+}
+
+/* Extend the frame index until it has more than n frames or the GIF
+ * trailer is found, walking blocks without decoding image data.
+ * The read position is restored afterwards.
+ * Return 0 on success or -1 if the data ends or is malformed. */
+static int
+index_frames(gd_GIF *gif, int n)
+{
+    off_t off = tell(gif);
+    uint8_t sep, label, flags;
+    char app_id[8];
+    gd_Frame f;
+    int ret = 0;
+
+    STATS(begin_phase(gif, GD_PHASE_PARSE);)
+    seek(gif, gif->index_end);
+    memset(&f, 0, sizeof(f));
+    f.offset = gif->index_end;
+    while (!gif->indexed && gif->nframes <= n) {
+        if (gif->limits.max_bytes && tell(gif) > gif->limits.max_bytes) {
+            ret = fail(gif, GD_ERR_LIMIT);
+            break;
+        }
+        sep = read_byte(gif);
+        if (sep == ',') {
+            f.fx = read_num(gif);
+            f.fy = read_num(gif);
+            f.fw = read_num(gif);
+            f.fh = read_num(gif);
+            flags = read_byte(gif);
+            f.lct = flags >> 7;
+            if (f.lct)
+                skip(gif, 3 << ((flags & 0x07) + 1));
+            /* Skip LZW minimum code size and image data. */
+            skip(gif, 1);
+            discard_sub_blocks(gif);
+            if (add_frame(gif, &f) == -1) {
+                ret = -1;
+                break;
+            }
+            gif->index_end = tell(gif);
+            memset(&f, 0, sizeof(f));
+            f.offset = gif->index_end;
+        } else if (sep == '!') {
+            label = read_byte(gif);
+            if (label == 0xF9) {
+                read_graphic_control_ext(gif, &f.gce);
+            } else if (label == 0xFF) {
+                skip(gif, 1);
+                read_data(gif, app_id, 8);
+                skip(gif, 3);
+                if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
+                    skip(gif, 2);
+                    gif->loop_count = read_num(gif);
+                }
+                discard_sub_blocks(gif);
+            } else {
+                discard_sub_blocks(gif);
+            }
+        } else if (sep == ';') {
+            gif->indexed = 1;
+        } else {
+            ret = fail(gif, GD_ERR_FORMAT);
+            break;
+        }
+    }
+    seek(gif, off);
+    STATS(end_phase(gif, GD_PHASE_PARSE);)
+    return ret;
+}
+
+int
+gd_probe(gd_GIF *gif, gd_Info *info)
+{
+    int i, ret;
+
+    pipeline_stop(gif);
+    ret = index_frames(gif, INT_MAX);
+    if (ret == 0)
+        publish_index(gif);
+    memset(info, 0, sizeof(*info));
+    info->width = gif->width;
+    info->height = gif->height;
+    info->loop_count = gif->loop_count;
+    info->nframes = gif->nframes;
+    for (i = 0; i < gif->nframes; i++)
+        info->duration += gif->frames[i].gce.delay;
+    return ret;
+}
+
+/* Start over from a blank canvas, with nothing left to dispose of. */
+static void
+clear_canvas(gd_GIF *gif)
+{
+    size_t n = (size_t) gif->width * gif->height;
+
+    if (gif->canvas) {
+        memset(gif->canvas, 0, canvas_bpp(gif) * n);
+        memset(gif->frame, gif->bgindex, n);
+        if (gif->mask)
+            memset(gif->mask, 0, n);
+    }
+    gif->covered = 0;
+    gif->fw = gif->fh = 0;
+    gif->tainted = 0;
+}
+
+static int
+seek_frame(gd_GIF *gif, int n)
+{
+    struct gd_Snapshot *snap;
+    gd_Rect damage = {0, 0, 0, 0};
+    int i, k, s, ret;
+
+    if (n < 0)
+        return 0;
+    if (!gif->canvas) {
+        if (alloc_buffers(gif) == -1)
+            return -1;
+        /* Nothing is left to decode forward from. */
+        gif->frame_no = -1;
+    }
+    if (n >= gif->nframes && index_frames(gif, n) == -1)
+        return -1;
+    if (n >= gif->nframes)
+        return 0;
+    if ((gif->frame_no != n || gif->ended) && (ret = load_frame(gif, n))) {
+        damage.w = gif->width;
+        damage.h = gif->height;
+        gif->damage = damage;
+        return ret;
+    }
+    /* Closest frame that can be decoded from scratch. */
+    for (k = n; k > 0 && !gif->frames[k].keyframe; k--)
+        ;
+    /* Closest snapshot that saves decoding from frame k. */
+    snap = NULL;
+    for (i = 0; i < gif->nsnaps; i++) {
+        s = gif->snaps[i].frame_no;
+        if (s >= k && s < n && (!snap || s > snap->frame_no))
+            snap = &gif->snaps[i];
+    }
+    /* Otherwise, decode forward from the current frame. */
+    if (gif->frame_no < k || gif->frame_no > n ||
+        (gif->frame_no == n && gif->ended) ||
+        (snap && snap->frame_no > gif->frame_no)) {
+        if (snap) {
+            memcpy(gif->canvas, snap->data, buffers_size(gif));
+            gif->covered = snap->covered;
+            seek(gif, snap->offset);
+            gif->frame_no = snap->frame_no;
+            snap->stamp = ++gif->snap_clock;
+            gif->snap_hits++;
+        } else {
+            if (gif->nsnaps)
+                gif->snap_misses++;
+            if (k == 0)
+                clear_canvas(gif);
+            seek(gif, gif->frames[k].offset);
+            gif->frame_no = k - 1;
+        }
+        /* The saved state has nothing left to dispose of. */
+        gif->fw = gif->fh = 0;
+        /* A new decoding pass, with its own max_pixels. */
+        gif->decoded = 0;
+        damage.w = gif->width;
+        damage.h = gif->height;
+    }
+    while (gif->frame_no < n) {
+        ret = gd_get_frame(gif);
+        if (ret == 0)
+            return fail(gif, GD_ERR_FORMAT);
+        if (ret == -1)
+            return -1;
+        add_rect(&damage, &gif->damage);
+    }
+    gif->damage = damage;
+    return 1;
+}
+
+/* Return 1 if frame n is now the current frame; 0 if there is no such
+ * frame; -1 if error. */
+int
+gd_seek_frame(gd_GIF *gif, int n)
+{
+    int depth = gif->pipe_depth, ret;
+
+    /* Seek without decoding ahead. The pipeline starts again with the
+     * next call to gd_get_frame(). */
+    pipeline_stop(gif);
+    gif->pipe_depth = 0;
+    ret = seek_frame(gif, n);
+    gif->pipe_depth = depth;
+    return ret;
 }
 
 void
 gd_rewind(gd_GIF *gif)
 {
-    lseek(gif->fd, gif->anim_start, SEEK_SET);
+    pipeline_stop(gif);
+    seek(gif, gif->anim_start);
+    gif->frame_no = -1;
+    gif->decoded = 0;
+    clear_canvas(gif);
+}
+
+/* Free the canvas, frame and decoder buffers, and snapshot contents, but
+ * keep the frame index. The next gd_get_frame() or gd_seek_frame()
+ * allocates them again and goes on from the current frame. */
+void
+gd_trim(gd_GIF *gif)
+{
+    int i;
+
+    pipeline_stop(gif);
+    for (i = 0; i < gif->nsnaps; i++) {
+        free_mem(&gif->alloc, gif->snaps[i].data);
+        gif->snaps[i].data = NULL;
+        gif->snaps[i].frame_no = -1;
+    }
+    free_lzw(&gif->alloc, gif->lzw);
+    free_mem(&gif->alloc, gif->canvas);
+    free_mem(&gif->alloc, gif->prev);
+    gif->lzw = NULL;
+    gif->canvas = gif->mask = gif->frame = NULL;
+    gif->covered = 0;
+    gif->prev = NULL;
+    gif->prev_size = 0;
 }
 
 void
 gd_close_gif(gd_GIF *gif)
 {
-    close(gif->fd);
-    free(gif);
+    gd_Allocator alloc = gif->alloc;
+
+    gd_set_cache(gif, NULL, 0);
+    gd_trim(gif);
+    if (gif->io.close)
+        gif->io.close(gif->io.user);
+    if (gif->push)
+        free_mem(&alloc, (void *) gif->buf);
+    gd_set_snapshots(gif, 0, 0);
+    free_mem(&alloc, gif->frames);
+    free_mem(&alloc, gif);
+}
+
+const char *
+gd_strerror(int error)
+{
+    switch (error) {
+    case GD_OK: return "no error";
+    case GD_ERR_IO: return "I/O error";
+    case GD_ERR_NOMEM: return "out of memory";
+    case GD_ERR_SIGNATURE: return "invalid signature";
+    case GD_ERR_VERSION: return "invalid version";
+    case GD_ERR_NO_GCT: return "no global color table";
+    case GD_ERR_FORMAT: return "malformed or truncated data";
+    case GD_ERR_LZW: return "invalid LZW code size";
+    case GD_ERR_LIMIT: return "limit exceeded";
+    default: return "unknown error";
+    }
+}
+
+/* Decode the frames asked for by job into job->pixels.
+ * Return 0 on success or an error code. */
+static int
+run_job(gd_Job *job)
+{
+    gd_GIF *gif;
+    gd_Info info;
+    size_t size;
+    int i, k, n, error = GD_OK;
+
+    if (job->fname)
+        gif = open_file(job->fname, &error);
+    else
+        gif = open_memory(job->data, job->size, &error);
+    if (!gif)
+        return error;
+    job->width = gif->width;
+    job->height = gif->height;
+    if (gd_set_limits(gif, &job->limits) == -1)
+        goto done;
+    n = MAX(job->nframes, 1);
+    if (n > 1) {
+        /* Sampling needs the number of frames. */
+        if (gd_probe(gif, &info) == -1)
+            goto done;
+        job->total = info.nframes;
+        n = MIN(n, info.nframes);
+        if (n == 0) {
+            gif->error = GD_ERR_FORMAT;
+            goto done;
+        }
+    }
+    size = (size_t) gif->width * gif->height * format_size(job->format);
+    job->pixels = malloc(n * size);
+    if (!job->pixels) {
+        gif->error = GD_ERR_NOMEM;
+        goto done;
+    }
+    for (i = 0; i < n; i++) {
+        k = (int) ((long long) i * job->total / n);
+        /* A single frame is just read, which works for truncated files. */
+        if ((n > 1 ? gd_seek_frame(gif, k) : gd_get_frame(gif)) != 1) {
+            if (!gif->error)
+                gif->error = GD_ERR_FORMAT;
+            break;
+        }
+        gd_render_frame_fmt(gif, job->pixels + i * size,
+                            gif->width * format_size(job->format),
+                            job->format);
+        job->count++;
+    }
+done:
+    error = gif->error;
+    gd_close_gif(gif);
+    return error;
+}
+
+#ifdef GD_THREADS
+/* Each worker owns a range of jobs, taken from the front. Idle workers
+ * steal the back half of the largest range left. */
+typedef struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int lo, hi;
+    struct Worker *all;
+    int nworkers;
+    gd_Job *jobs;
+} Worker;
+
+/* Return the index of the next job for w, or -1 if there is none left. */
+static int
+next_job(Worker *w)
+{
+    Worker *v, *victim;
+    int i, lo, hi, size, best;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        i = w->lo < w->hi ? w->lo++ : -1;
+        pthread_mutex_unlock(&w->lock);
+        if (i != -1)
+            return i;
+        victim = NULL;
+        best = 0;
+        for (v = w->all; v < &w->all[w->nworkers]; v++) {
+            if (v == w)
+                continue;
+            pthread_mutex_lock(&v->lock);
+            size = v->hi - v->lo;
+            pthread_mutex_unlock(&v->lock);
+            if (size > best) {
+                best = size;
+                victim = v;
+            }
+        }
+        if (!victim)
+            return -1;
+        pthread_mutex_lock(&victim->lock);
+        hi = victim->hi;
+        lo = hi - (hi - victim->lo + 1) / 2;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+        /* The victim may have run out meanwhile: then lo == hi. */
+        pthread_mutex_lock(&w->lock);
+        w->lo = lo;
+        w->hi = hi;
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static void *
+work(void *arg)
+{
+    Worker *w = arg;
+    int i;
+
+    while ((i = next_job(w)) != -1)
+        w->jobs[i].error = run_job(&w->jobs[i]);
+    return NULL;
+}
+#endif
+
+/* Run njobs independent decoding jobs on up to nthreads threads.
+ * Return 0 when all jobs were run, even if some of them failed, or -1 if
+ * the worker threads couldn't be created. */
+int
+gd_decode_batch(gd_Job *jobs, int njobs, int nthreads)
+{
+    int i;
+#ifdef GD_THREADS
+    Worker *workers;
+    int n, started, ret = 0;
+#endif
+
+    for (i = 0; i < njobs; i++) {
+        jobs[i].error = GD_OK;
+        jobs[i].width = jobs[i].height = 0;
+        jobs[i].total = 0;
+        jobs[i].count = 0;
+        jobs[i].pixels = NULL;
+    }
+#ifdef GD_THREADS
+    n = MIN(MAX(nthreads, 1), MAX(njobs, 1));
+    if (n > 1) {
+        workers = calloc(n, sizeof(*workers));
+        if (!workers)
+            return -1;
+        for (i = 0; i < n; i++) {
+            pthread_mutex_init(&workers[i].lock, NULL);
+            workers[i].lo = (int) ((long) njobs * i / n);
+            workers[i].hi = (int) ((long) njobs * (i + 1) / n);
+            workers[i].all = workers;
+            workers[i].nworkers = n;
+            workers[i].jobs = jobs;
+        }
+        for (started = 0; started < n; started++)
+            if (pthread_create(&workers[started].thread, NULL, work,
+                               &workers[started]))
+                break;
+        /* Jobs of threads that didn't start are stolen by the others. */
+        if (!started)
+            ret = -1;
+        for (i = 0; i < started; i++)
+            pthread_join(workers[i].thread, NULL);
+        for (i = 0; i < n; i++)
+            pthread_mutex_destroy(&workers[i].lock);
+        free(workers);
+        return ret;
+    }
+#else
+    (void) nthreads;
+#endif
+    for (i = 0; i < njobs; i++)
+        jobs[i].error = run_job(&jobs[i]);
+    return 0;
 }
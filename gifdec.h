@@ -4,6 +4,47 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+/* Pixel formats for gd_render_frame_fmt(), named by byte order. */
+enum {
+    GD_RGB,         /* 24-bit R, G, B */
+    GD_RGBA,        /* 32-bit R, G, B, A */
+    GD_BGRA,        /* 32-bit B, G, R, A */
+    GD_RGBA_PREMUL, /* GD_RGBA with premultiplied alpha */
+    GD_BGRA_PREMUL, /* GD_BGRA with premultiplied alpha */
+    GD_RGB565,      /* 16-bit native-endian, red in the high bits */
+    GD_INDEXED      /* 8-bit palette index from gif->frame */
+};
+
+/* Error codes, as stored in gif->error, or by the gd_open_gif*_ex()
+ * functions when opening fails. */
+enum {
+    GD_OK,
+    GD_ERR_IO,
+    GD_ERR_NOMEM,
+    GD_ERR_SIGNATURE,
+    GD_ERR_VERSION,
+    GD_ERR_NO_GCT,
+    GD_ERR_FORMAT,
+    GD_ERR_LZW,
+    GD_ERR_LIMIT
+};
+
+/* Results of gd_feed(), besides -1 on error. */
+enum {
+    GD_FEED_MORE,  /* all data used, more is needed */
+    GD_FEED_FRAME, /* a frame is complete */
+    GD_FEED_END    /* GIF trailer reached */
+};
+
+/* Phases timed in gif->stats, and passed to gif->trace. */
+enum {
+    GD_PHASE_PARSE,   /* reading blocks, descriptors and color tables */
+    GD_PHASE_DECODE,  /* LZW decoding into gif->frame */
+    GD_PHASE_DISPOSE, /* frame disposal, and saving for method 3 */
+    GD_PHASE_RENDER,  /* compositing, and writing output buffers */
+    GD_NPHASES
+};
+
 typedef struct gd_Palette {
     int size;
     uint8_t colors[0x100 * 3];
@@ -17,8 +58,69 @@ typedef struct gd_GCE {
     int transparency;
 } gd_GCE;
 
+typedef struct gd_IO {
+    ssize_t (*read)(void *user, void *buf, size_t len);
+    off_t (*seek)(void *user, off_t offset, int whence);
+    const void *(*map)(void *user, off_t offset, size_t *len);
+    void (*close)(void *user);
+    void *user;
+} gd_IO;
+
+typedef struct gd_Allocator {
+    void *(*malloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} gd_Allocator;
+
+typedef struct gd_Frame {
+    off_t offset;
+    uint16_t fx, fy, fw, fh;
+    gd_GCE gce;
+    uint8_t lct;
+    uint8_t keyframe;
+} gd_Frame;
+
+typedef struct gd_Rect {
+    uint16_t x, y, w, h;
+} gd_Rect;
+
+typedef struct gd_Info {
+    uint16_t width, height;
+    uint16_t loop_count;
+    int nframes;
+    uint32_t duration;
+} gd_Info;
+
+/* Counters kept when gifdec is compiled with GD_STATS. */
+typedef struct gd_Stats {
+    uint64_t bytes_read;
+    uint64_t io_calls;
+    uint64_t codes;  /* LZW codes decoded */
+    uint64_t resets; /* LZW clear codes */
+    uint64_t pixels; /* frame pixels composited onto the canvas */
+    uint64_t ns[GD_NPHASES]; /* time spent in each phase */
+} gd_Stats;
+
+/* What a handle may use, for gd_set_limits(). 0 means no limit. */
+typedef struct gd_Limits {
+    uint64_t max_canvas; /* width * height */
+    int max_frames;
+    uint64_t max_pixels; /* frame pixels decoded in one pass */
+    off_t max_bytes;     /* how far into the input to read */
+} gd_Limits;
+
+/* Decoded data shared between handles, see gd_open_cache(). */
+typedef struct gd_Cache gd_Cache;
+
 typedef struct gd_GIF {
     int fd;
+    gd_IO io;
+    gd_Allocator alloc;
+    const uint8_t *buf;
+    size_t buf_pos, buf_len;
+    off_t buf_off;
+    size_t mem_size;
     off_t anim_start;
     uint16_t width, height;
     uint16_t depth;
@@ -33,15 +135,94 @@ typedef struct gd_GIF {
     );
     void (*comment)(struct gd_GIF *gif);
     void (*application)(struct gd_GIF *gif, char id[8], char auth[3]);
+    void (*trace)(struct gd_GIF *gif, int phase, int end);
     uint16_t fx, fy, fw, fh;
+    gd_Rect damage;
     uint8_t bgindex;
-    uint8_t *canvas, *frame;
+    uint8_t *canvas, *mask, *frame;
+    int covered;
+    int compact;
+    int error;
+    gd_Limits limits;
+    uint64_t decoded;
+    struct gd_Pipe *pipe;
+    int pipe_depth;
+    int decode_threads;
+    int push;
+    size_t push_size;
+    int feed_rows;
+    gd_Stats stats;
+    uint64_t phase_start[GD_NPHASES];
+    uint8_t lut[0x100][4];
+    int lut_key;
+    uint8_t *prev;
+    size_t prev_size;
+    struct gd_LZW *lzw;
+    gd_Frame *frames;
+    int nframes, frames_size;
+    int indexed;
+    off_t index_end;
+    int frame_no;
+    int ended;
+    int tainted;
+    struct gd_Snapshot *snaps;
+    int nsnaps, snap_interval;
+    size_t snap_budget;
+    unsigned snap_clock;
+    unsigned long snap_hits, snap_misses;
+    gd_Cache *cache;
+    struct gd_CacheEntry *cache_entry;
+    int cache_frames;
 } gd_GIF;
 
+typedef struct gd_Job {
+    /* Input: a file name, or data and size when it's NULL. */
+    const char *fname;
+    const void *data;
+    size_t size;
+    int nframes;
+    int format;
+    gd_Limits limits;
+    /* Output. */
+    int error;
+    uint16_t width, height;
+    int total, count;
+    uint8_t *pixels;
+} gd_Job;
+
 gd_GIF *gd_open_gif(const char *fname);
+gd_GIF *gd_open_gif_memory(const void *data, size_t len);
+gd_GIF *gd_open_gif_io(const gd_IO *io, const gd_Allocator *alloc);
+gd_GIF *gd_open_gif_ex(const char *fname, int *error);
+gd_GIF *gd_open_gif_memory_ex(const void *data, size_t len, int *error);
+gd_GIF *gd_open_gif_io_ex(const gd_IO *io, const gd_Allocator *alloc,
+                          int *error);
+gd_GIF *gd_open_gif_push(const gd_Allocator *alloc);
+int gd_feed(gd_GIF *gif, const void *data, size_t len);
+size_t gd_read(gd_GIF *gif, void *buf, size_t len);
 int gd_get_frame(gd_GIF *gif);
+int gd_decode_first_frame(gd_GIF *gif, void *buffer, int stride, int format);
 void gd_render_frame(gd_GIF *gif, uint8_t *buffer);
+void gd_render_frame_fmt(gd_GIF *gif, void *buffer, int stride, int format);
+void gd_render_damage(gd_GIF *gif, void *buffer, int stride, int format);
+void gd_render_scaled(gd_GIF *gif, void *buffer, int stride, int format,
+                      int width, int height);
+int gd_probe(gd_GIF *gif, gd_Info *info);
+int gd_seek_frame(gd_GIF *gif, int n);
+int gd_set_snapshots(gd_GIF *gif, int interval, size_t budget);
+int gd_set_compact(gd_GIF *gif);
+int gd_set_pipeline(gd_GIF *gif, int depth);
+int gd_set_decode_threads(gd_GIF *gif, int nthreads);
+int gd_set_limits(gd_GIF *gif, const gd_Limits *limits);
 void gd_rewind(gd_GIF *gif);
+void gd_trim(gd_GIF *gif);
+const char *gd_strerror(int error);
+/* Without GD_THREADS, jobs run one after the other on the calling thread,
+ * whatever nthreads is. */
+int gd_decode_batch(gd_Job *jobs, int njobs, int nthreads);
+gd_Cache *gd_open_cache(size_t budget, const gd_Allocator *alloc);
+int gd_set_cache(gd_GIF *gif, gd_Cache *cache, int frames);
+void gd_close_cache(gd_Cache *cache);
 void gd_close_gif(gd_GIF *gif);
 
 #endif /* GIFDEC_H */
@@ -0,0 +1,822 @@
+/* gifdec tests -- decoding through a shared cache, pushed, seeking,
+ * trimmed, from other sources and on threads, against decoding alone,
+ * compositing, against a plain reference, and limits
+ * compiling:
+ *   cc -o test gifdec.c test.c
+ *   cc -DGD_NO_SIMD -o test gifdec.c test.c
+ *   cc -DGD_THREADS -pthread -o test gifdec.c test.c
+ * executing:
+ *   ./test
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gifdec.h"
+
+#define W 4
+#define H 4
+#define FRAME_SIZE (W * H * 4)
+#define NFRAMES 4
+
+typedef struct Writer {
+    uint8_t *data;
+    size_t len, size;
+} Writer;
+
+static void
+put(Writer *w, const void *data, size_t len)
+{
+    while (w->len + len > w->size) {
+        w->size = w->size ? w->size * 2 : 1 << 16;
+        w->data = realloc(w->data, w->size);
+        if (!w->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(&w->data[w->len], data, len);
+    w->len += len;
+}
+
+static void
+put_byte(Writer *w, uint8_t b)
+{
+    put(w, &b, 1);
+}
+
+static void
+put_num(Writer *w, uint16_t n)
+{
+    put_byte(w, n & 0xFF);
+    put_byte(w, n >> 8);
+}
+
+typedef struct Codes {
+    Writer *w;
+    uint8_t block[255];
+    int n;
+    uint32_t bits;
+    int nbits, width;
+} Codes;
+
+static void
+put_block(Codes *c)
+{
+    put_byte(c->w, c->n);
+    put(c->w, c->block, c->n);
+    c->n = 0;
+}
+
+static void
+put_code(Codes *c, int code)
+{
+    c->bits |= (uint32_t) code << c->nbits;
+    for (c->nbits += c->width; c->nbits >= 8; c->nbits -= 8) {
+        c->block[c->n++] = c->bits & 0xFF;
+        c->bits >>= 8;
+        if (c->n == 255)
+            put_block(c);
+    }
+}
+
+/* Write a frame of fw * fh pixels, with LZW codes of min_size + 1 bits
+ * that are all literals: a clear code before every (1 << min_size) - 2
+ * pixels keeps the table from growing to wider codes. tindex is the
+ * transparent index, or -1 for none, and lct a local palette of 256
+ * colors, or NULL for none. */
+static void
+put_image(Writer *w, int x, int y, int fw, int fh, const uint8_t *pix,
+          int min_size, int disposal, int tindex, const uint8_t *lct)
+{
+    int i, clear = 1 << min_size, run = clear - 2;
+    Codes c;
+
+    put(w, "\x21\xF9\x04", 3);
+    put_byte(w, disposal << 2 | (tindex >= 0));
+    put_num(w, 10);
+    put_byte(w, tindex >= 0 ? tindex : 0);
+    put_byte(w, 0);
+    put_byte(w, 0x2C);
+    put_num(w, x);
+    put_num(w, y);
+    put_num(w, fw);
+    put_num(w, fh);
+    put_byte(w, lct ? 0x87 : 0);
+    if (lct)
+        put(w, lct, 0x100 * 3);
+    put_byte(w, min_size);
+    memset(&c, 0, sizeof(c));
+    c.w = w;
+    c.width = min_size + 1;
+    for (i = 0; i < fw * fh; i++) {
+        if (i % run == 0)
+            put_code(&c, clear);
+        put_code(&c, pix[i]);
+    }
+    put_code(&c, clear + 1);
+    if (c.nbits)
+        c.block[c.n++] = c.bits & 0xFF;
+    if (c.n)
+        put_block(&c);
+    put_byte(w, 0);
+}
+
+/* Write an opaque frame of one color, out of a 4-color palette. */
+static void
+put_frame(Writer *w, int x, int y, int fw, int fh, int color, int disposal)
+{
+    uint8_t pix[W * H];
+
+    memset(pix, color, fw * fh);
+    put_image(w, x, y, fw, fh, pix, 2, disposal, -1, NULL);
+}
+
+/* An animation whose first frame doesn't cover the canvas, so drawing it
+ * over anything but a blank canvas shows. */
+static void
+make_gif(Writer *w)
+{
+    static const uint8_t gct[12] = {
+        0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255
+    };
+
+    put(w, "GIF89a", 6);
+    put_num(w, W);
+    put_num(w, H);
+    put(w, "\x81\x00\x00", 3);
+    put(w, gct, sizeof(gct));
+    put_frame(w, 0, 0, 2, 2, 1, 1);
+    put_frame(w, 2, 2, 2, 2, 2, 1);
+    put_frame(w, 1, 1, 2, 2, 3, 2);
+    put_frame(w, 0, 2, 2, 2, 3, 3);
+    put_byte(w, 0x3B);
+}
+
+/* Odd sizes, so that rows end between vector widths. */
+#define BW 61
+#define BH 7
+#define BFRAMES 5
+
+typedef struct Blit {
+    int x, y, w, h, disposal, tindex, lct;
+} Blit;
+
+/* Frames that are drawn with and without transparency, onto a canvas
+ * with and without a mask, and disposed of in every way. The one with a
+ * local palette turns a compact canvas into RGB. */
+static const Blit blits[BFRAMES] = {
+    {0, 0, BW, BH, 1, -1, 0},
+    {3, 1, 47, 5, 0, 7, 0},
+    {5, 0, 33, 7, 2, -1, 0},
+    {1, 2, 51, 4, 3, 200, 1},
+    {40, 3, 17, 3, 0, -1, 0},
+};
+
+static void
+gct_color(int i, uint8_t rgb[3])
+{
+    rgb[0] = i;
+    rgb[1] = 255 - i;
+    rgb[2] = i * 7;
+}
+
+/* The local palette is the global one backwards. */
+static void
+blit_color(const Blit *b, int i, uint8_t rgb[3])
+{
+    gct_color(b->lct ? 255 - i : i, rgb);
+}
+
+static uint8_t
+random_index(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16 & 0xFF;
+}
+
+/* An animation of blits[first..], with random pixels out of 256 colors,
+ * a quarter of them transparent in frames that have transparency. */
+static void
+make_blit_gif(Writer *w, int first, uint8_t pix[BFRAMES][BW * BH])
+{
+    const Blit *b;
+    uint8_t rgb[3], lct[0x100 * 3];
+    unsigned seed = 1;
+    int i, n;
+
+    for (i = 0; i < 0x100; i++)
+        gct_color(255 - i, &lct[i * 3]);
+    w->len = 0;
+    put(w, "GIF89a", 6);
+    put_num(w, BW);
+    put_num(w, BH);
+    put(w, "\x87\x00\x00", 3);
+    for (i = 0; i < 0x100; i++) {
+        gct_color(i, rgb);
+        put(w, rgb, 3);
+    }
+    for (n = first; n < BFRAMES; n++) {
+        b = &blits[n];
+        for (i = 0; i < b->w * b->h; i++) {
+            pix[n][i] = random_index(&seed);
+            if (b->tindex >= 0 && pix[n][i] % 4 == 0)
+                pix[n][i] = b->tindex;
+        }
+        put_image(w, b->x, b->y, b->w, b->h, pix[n], 8,
+                  b->disposal, b->tindex, b->lct ? lct : NULL);
+    }
+    put_byte(w, 0x3B);
+}
+
+/* Composite the frames of make_blit_gif() in plain C, as RGBA. */
+static void
+composite(int first, uint8_t pix[BFRAMES][BW * BH],
+          uint8_t ref[BFRAMES][BW * BH * 4])
+{
+    uint8_t canvas[BW * BH * 4], prev[BW * BH * 4], *p;
+    const Blit *b;
+    int i, j, n;
+
+    memset(canvas, 0, sizeof(canvas));
+    for (n = first; n < BFRAMES; n++) {
+        b = &blits[n];
+        memcpy(prev, canvas, sizeof(canvas));
+        for (j = 0; j < b->h; j++) {
+            for (i = 0; i < b->w; i++) {
+                if (pix[n][j * b->w + i] == b->tindex)
+                    continue;
+                p = &canvas[((b->y + j) * BW + b->x + i) * 4];
+                blit_color(b, pix[n][j * b->w + i], p);
+                p[3] = 255;
+            }
+        }
+        memcpy(ref[n], canvas, sizeof(canvas));
+        for (j = 0; j < b->h; j++) {
+            for (i = 0; i < b->w; i++) {
+                p = &canvas[((b->y + j) * BW + b->x + i) * 4];
+                if (b->disposal == 2) {
+                    gct_color(0, p);
+                    p[3] = 0;
+                } else if (b->disposal == 3) {
+                    memcpy(p, &prev[(p - canvas)], 4);
+                }
+            }
+        }
+    }
+}
+
+static int failed;
+
+static void
+check(gd_GIF *gif, uint8_t *damage, const uint8_t *ref, const char *what)
+{
+    uint8_t full[FRAME_SIZE];
+    int n = gif->frame_no;
+
+    gd_render_frame_fmt(gif, full, W * 4, GD_RGBA);
+    if (memcmp(full, &ref[n * FRAME_SIZE], FRAME_SIZE)) {
+        fprintf(stderr, "%s: frame %d differs\n", what, n);
+        failed = 1;
+    }
+    if (!damage)
+        return;
+    gd_render_damage(gif, damage, W * 4, GD_RGBA);
+    if (memcmp(damage, &ref[n * FRAME_SIZE], FRAME_SIZE)) {
+        fprintf(stderr, "%s: damage of frame %d differs\n", what, n);
+        failed = 1;
+    }
+}
+
+/* Check that the frames of make_blit_gif() are drawn as composite()
+ * draws them, by whatever kernels this build and CPU use. */
+static void
+check_blits(int first, int compact)
+{
+    static uint8_t pix[BFRAMES][BW * BH], ref[BFRAMES][BW * BH * 4];
+    static Writer w;
+    uint8_t out[BW * BH * 4];
+    gd_GIF *gif;
+    int n, rgb = !compact;
+
+    make_blit_gif(&w, first, pix);
+    composite(first, pix, ref);
+    gif = gd_open_gif_memory(w.data, w.len);
+    if (compact)
+        gd_set_compact(gif);
+    for (n = first; gd_get_frame(gif) == 1; n++) {
+        rgb |= n < BFRAMES && blits[n].lct;
+        if (gif->compact == rgb) {
+            fprintf(stderr, "blits from %d: frame %d is %s\n", first, n,
+                    gif->compact ? "compact" : "RGB");
+            failed = 1;
+        }
+        gd_render_frame_fmt(gif, out, BW * 4, GD_RGBA);
+        if (n >= BFRAMES || memcmp(out, ref[n], sizeof(out))) {
+            fprintf(stderr, "blits from %d%s: frame %d differs\n", first,
+                    compact ? ", compact" : "", n);
+            failed = 1;
+        }
+    }
+    if (n != BFRAMES) {
+        fprintf(stderr, "blits from %d: %d frames, %s\n", first, n,
+                gd_strerror(gif->error));
+        failed = 1;
+    }
+    gd_close_gif(gif);
+}
+
+/* Play gif through, loops times over, checking every frame. */
+static void
+play(gd_GIF *gif, int loops, const uint8_t *ref, const char *what)
+{
+    uint8_t damage[FRAME_SIZE];
+    int i, n, ret;
+
+    memset(damage, 0, sizeof(damage));
+    for (i = 0; i < loops; i++) {
+        gd_rewind(gif);
+        for (n = 0; (ret = gd_get_frame(gif)) == 1; n++)
+            check(gif, damage, ref, what);
+        if (ret != 0 || n != NFRAMES) {
+            fprintf(stderr, "%s: %d frames, %s\n", what, n,
+                    gd_strerror(gif->error));
+            failed = 1;
+            return;
+        }
+    }
+}
+
+/* The blit animation from its first frame, and its frames as decoded
+ * alone, for the checks below. */
+static Writer anim;
+static uint8_t anim_ref[BFRAMES][BW * BH * 4];
+
+static int
+load_anim(void)
+{
+    static uint8_t pix[BFRAMES][BW * BH];
+    gd_GIF *gif;
+    int n;
+
+    make_blit_gif(&anim, 0, pix);
+    gif = gd_open_gif_memory(anim.data, anim.len);
+    for (n = 0; n < BFRAMES && gd_get_frame(gif) == 1; n++)
+        gd_render_frame_fmt(gif, anim_ref[n], BW * 4, GD_RGBA);
+    gd_close_gif(gif);
+    return n == BFRAMES ? 0 : -1;
+}
+
+static void
+same_frame(gd_GIF *gif, const char *what)
+{
+    uint8_t out[BW * BH * 4];
+    int n = gif->frame_no;
+
+    gd_render_frame_fmt(gif, out, BW * 4, GD_RGBA);
+    if (n < 0 || n >= BFRAMES || memcmp(out, anim_ref[n], sizeof(out))) {
+        fprintf(stderr, "%s: frame %d differs\n", what, n);
+        failed = 1;
+    }
+}
+
+/* Play the blit animation through from the current frame on. */
+static void
+play_anim(gd_GIF *gif, const char *what)
+{
+    int n, ret;
+
+    for (n = gif->frame_no + 1; (ret = gd_get_frame(gif)) == 1; n++)
+        same_frame(gif, what);
+    if (ret != 0 || n != BFRAMES) {
+        fprintf(stderr, "%s: %d frames, %s\n", what, n,
+                gd_strerror(gif->error));
+        failed = 1;
+    }
+}
+
+/* Push the blit animation byte by byte, in pieces of random sizes, and
+ * all at once. */
+static void
+check_push(void)
+{
+    static const size_t steps[] = {1, 0, 1 << 16};
+    unsigned seed = 3;
+    size_t pos, len;
+    gd_GIF *gif;
+    int i, n, ret;
+
+    for (i = 0; i < 3; i++) {
+        gif = gd_open_gif_push(NULL);
+        ret = GD_FEED_MORE;
+        for (pos = n = 0; pos < anim.len && ret == GD_FEED_MORE; pos += len) {
+            len = steps[i] ? steps[i] : (size_t) random_index(&seed) % 64 + 1;
+            if (len > anim.len - pos)
+                len = anim.len - pos;
+            ret = gd_feed(gif, &anim.data[pos], len);
+            for (; ret == GD_FEED_FRAME; n++) {
+                same_frame(gif, "push");
+                ret = gd_feed(gif, NULL, 0);
+            }
+        }
+        if (ret != GD_FEED_END || n != BFRAMES) {
+            fprintf(stderr, "push by %d: %d frames, %s\n", (int) steps[i], n,
+                    gd_strerror(gif->error));
+            failed = 1;
+        }
+        gd_close_gif(gif);
+    }
+}
+
+/* Seek around, with and without snapshots, from a handle that has played
+ * the animation through. */
+static void
+check_seek(void)
+{
+    static const int seeks[] = {4, 0, 3, 1, 2, 4, 2, 0, 3, 3};
+    gd_GIF *gif;
+    int i, k;
+
+    for (i = 0; i < 2; i++) {
+        gif = gd_open_gif_memory(anim.data, anim.len);
+        if (i) {
+            if (gd_set_snapshots(gif, 1, (size_t) 1 << 20) < 1) {
+                fprintf(stderr, "gd_set_snapshots() failed\n");
+                failed = 1;
+            }
+            play_anim(gif, "snapshots");
+        }
+        for (k = 0; k < (int) (sizeof(seeks) / sizeof(seeks[0])); k++) {
+            if (gd_seek_frame(gif, seeks[k]) != 1) {
+                fprintf(stderr, "seeking frame %d failed\n", seeks[k]);
+                failed = 1;
+                continue;
+            }
+            same_frame(gif, i ? "snapshot seek" : "seek");
+        }
+        if (i && !gif->snap_hits) {
+            fprintf(stderr, "snapshots: never restored\n");
+            failed = 1;
+        }
+        gd_close_gif(gif);
+    }
+}
+
+/* Trim after every frame, on RGB and compact canvases, and carry on. */
+static void
+check_trim(void)
+{
+    static const uint8_t blank[BW * BH * 4];
+    uint8_t out[BW * BH * 4];
+    gd_GIF *gif;
+    int i, n;
+
+    for (i = 0; i < 2 * BFRAMES; i++) {
+        gif = gd_open_gif_memory(anim.data, anim.len);
+        if (i >= BFRAMES)
+            gd_set_compact(gif);
+        for (n = 0; n <= i % BFRAMES && gd_get_frame(gif) == 1; n++)
+            ;
+        gd_trim(gif);
+        gd_render_frame_fmt(gif, out, BW * 4, GD_RGBA);
+        if (memcmp(out, blank, sizeof(out))) {
+            fprintf(stderr, "trim after frame %d: canvas isn't blank\n", n);
+            failed = 1;
+        }
+        play_anim(gif, "trim");
+        gd_trim(gif);
+        if (gd_seek_frame(gif, i % BFRAMES) == 1)
+            same_frame(gif, "trim and seek");
+        else
+            failed = 1;
+        gd_close_gif(gif);
+    }
+}
+
+/* Get frames until gd_get_frame() stops, and check that it stops after n
+ * of them because of a limit. */
+static void
+expect_limit(gd_GIF *gif, int n, const char *what)
+{
+    int k, ret;
+
+    for (k = 0; (ret = gd_get_frame(gif)) == 1; k++)
+        same_frame(gif, what);
+    if (k != n || ret != -1 || gif->error != GD_ERR_LIMIT) {
+        fprintf(stderr, "%s: %d frames, %s\n", what, k,
+                gd_strerror(gif->error));
+        failed = 1;
+    }
+}
+
+static void
+check_limits(void)
+{
+    gd_Limits limits;
+    gd_GIF *gif;
+
+    memset(&limits, 0, sizeof(limits));
+    gif = gd_open_gif_memory(anim.data, anim.len);
+    limits.max_canvas = BW * BH - 1;
+    if (gd_set_limits(gif, &limits) != -1 || gif->error != GD_ERR_LIMIT) {
+        fprintf(stderr, "max_canvas: not enforced\n");
+        failed = 1;
+    }
+    limits.max_canvas = BW * BH;
+    limits.max_frames = 2;
+    if (gd_set_limits(gif, &limits) || gif->error != GD_OK) {
+        fprintf(stderr, "max_canvas: the canvas fits\n");
+        failed = 1;
+    }
+    expect_limit(gif, 2, "max_frames");
+    gd_close_gif(gif);
+    /* Frame pixels are counted from the start of each pass. Setting the
+     * limits again clears the error. */
+    gif = gd_open_gif_memory(anim.data, anim.len);
+    memset(&limits, 0, sizeof(limits));
+    limits.max_pixels = blits[0].w * blits[0].h + blits[1].w * blits[1].h;
+    gd_set_limits(gif, &limits);
+    expect_limit(gif, 2, "max_pixels");
+    gd_set_limits(gif, &limits);
+    gd_rewind(gif);
+    expect_limit(gif, 2, "max_pixels after gd_rewind()");
+    limits.max_pixels = 0;
+    gd_set_limits(gif, &limits);
+    gd_rewind(gif);
+    play_anim(gif, "no max_pixels");
+    gd_close_gif(gif);
+    /* Cut the last frame short. */
+    gif = gd_open_gif_memory(anim.data, anim.len);
+    limits.max_bytes = anim.len - 60;
+    gd_set_limits(gif, &limits);
+    expect_limit(gif, BFRAMES - 1, "max_bytes");
+    gd_close_gif(gif);
+    gif = gd_open_gif_push(NULL);
+    gd_set_limits(gif, &limits);
+    if (gd_feed(gif, anim.data, anim.len) != -1 ||
+        gif->error != GD_ERR_LIMIT) {
+        fprintf(stderr, "max_bytes: not enforced on a push handle\n");
+        failed = 1;
+    }
+    gd_close_gif(gif);
+}
+
+/* A source that reads at most step bytes at a time, or maps them. */
+typedef struct Source {
+    const uint8_t *data;
+    size_t len, step;
+    off_t pos;
+    int closed;
+} Source;
+
+static ssize_t
+source_read(void *user, void *buf, size_t len)
+{
+    Source *s = user;
+    size_t left = s->len - s->pos;
+
+    len = len < s->step ? len : s->step;
+    len = len < left ? len : left;
+    memcpy(buf, &s->data[s->pos], len);
+    s->pos += len;
+    return len;
+}
+
+static off_t
+source_seek(void *user, off_t offset, int whence)
+{
+    Source *s = user;
+
+    if (whence == SEEK_CUR)
+        offset += s->pos;
+    else if (whence == SEEK_END)
+        offset += s->len;
+    if (offset < 0 || offset > (off_t) s->len)
+        return -1;
+    return s->pos = offset;
+}
+
+static const void *
+source_map(void *user, off_t offset, size_t *len)
+{
+    Source *s = user;
+
+    if (offset >= (off_t) s->len)
+        return NULL;
+    *len = s->len - offset < s->step ? s->len - offset : s->step;
+    return &s->data[offset];
+}
+
+static void
+source_close(void *user)
+{
+    ((Source *) user)->closed++;
+}
+
+/* Open the blit animation through gd_IO callbacks: read-only, seekable,
+ * and mapped. */
+static void
+check_sources(void)
+{
+    /* Headers of a 1x1 image without a global palette. */
+    static const char bad[3][14] = {
+        "PNG89a\1\0\1\0\0\0\0", "GIF87a\1\0\1\0\0\0\0",
+        "GIF89a\1\0\1\0\0\0\0"
+    };
+    static const int errors[] = {
+        GD_ERR_SIGNATURE, GD_ERR_VERSION, GD_ERR_NO_GCT
+    };
+    Source s;
+    gd_IO io;
+    gd_GIF *gif;
+    int i, error;
+
+    for (i = 0; i < 4; i++) {
+        memset(&s, 0, sizeof(s));
+        s.data = anim.data;
+        s.len = anim.len;
+        s.step = i < 3 ? 7 : 1 << 16;
+        memset(&io, 0, sizeof(io));
+        if (i < 2)
+            io.read = source_read;
+        else
+            io.map = source_map;
+        if (i)
+            io.seek = source_seek;
+        io.close = source_close;
+        io.user = &s;
+        gif = gd_open_gif_io(&io, NULL);
+        play_anim(gif, "gd_IO");
+        if (io.seek) {
+            gd_rewind(gif);
+            play_anim(gif, "gd_IO after gd_rewind()");
+            if (gd_seek_frame(gif, 2) == 1)
+                same_frame(gif, "gd_IO seek");
+            else
+                failed = 1;
+        }
+        gd_close_gif(gif);
+        if (s.closed != 1) {
+            fprintf(stderr, "gd_IO: closed %d times\n", s.closed);
+            failed = 1;
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        s.data = (const uint8_t *) bad[i];
+        s.len = 13;
+        s.step = 7;
+        s.pos = s.closed = 0;
+        memset(&io, 0, sizeof(io));
+        io.read = source_read;
+        io.close = source_close;
+        io.user = &s;
+        gif = gd_open_gif_memory_ex(s.data, s.len, &error);
+        if (gif || error != errors[i]) {
+            fprintf(stderr, "bad GIF %d in memory: %s\n", i,
+                    gd_strerror(error));
+            failed = 1;
+        }
+        gif = gd_open_gif_io_ex(&io, NULL, &error);
+        if (gif || error != errors[i] || s.closed != 1) {
+            fprintf(stderr, "bad GIF %d through gd_IO: %s\n", i,
+                    gd_strerror(error));
+            failed = 1;
+        }
+    }
+}
+
+#ifdef GD_THREADS
+/* Play through a pipeline, and decode a frame big enough to be split
+ * between threads, against doing both on one thread. */
+static void
+check_threads(void)
+{
+    static const int seeks[] = {3, 0, 4, 1, 1, 2};
+    uint8_t gct[0x100 * 3], *pix, *out[2];
+    unsigned seed = 5;
+    Writer w = {NULL, 0, 0};
+    gd_GIF *gif;
+    int i, n;
+
+    gif = gd_open_gif_memory(anim.data, anim.len);
+    if (gd_set_pipeline(gif, 2)) {
+        fprintf(stderr, "gd_set_pipeline() failed\n");
+        failed = 1;
+    }
+    for (i = 0; i < 2; i++) {
+        gd_rewind(gif);
+        play_anim(gif, "pipeline");
+    }
+    for (i = 0; i < (int) (sizeof(seeks) / sizeof(seeks[0])); i++) {
+        if (gd_seek_frame(gif, seeks[i]) == 1)
+            same_frame(gif, "pipeline seek");
+        else
+            failed = 1;
+    }
+    gd_close_gif(gif);
+    n = 2048 * 1024;
+    pix = malloc(n);
+    out[0] = malloc(n * 3);
+    out[1] = malloc(n * 3);
+    for (i = 0; i < n; i++)
+        pix[i] = random_index(&seed);
+    for (i = 0; i < 0x100; i++)
+        gct_color(i, &gct[i * 3]);
+    put(&w, "GIF89a", 6);
+    put_num(&w, 2048);
+    put_num(&w, 1024);
+    put(&w, "\x87\x00\x00", 3);
+    put(&w, gct, sizeof(gct));
+    put_image(&w, 0, 0, 2048, 1024, pix, 8, 0, -1, NULL);
+    put_byte(&w, 0x3B);
+    for (i = 0; i < 2; i++) {
+        gif = gd_open_gif_memory(w.data, w.len);
+        if (gd_set_decode_threads(gif, i ? 4 : 1)) {
+            fprintf(stderr, "gd_set_decode_threads() failed\n");
+            failed = 1;
+        }
+        if (gd_get_frame(gif) != 1) {
+            fprintf(stderr, "threads: %s\n", gd_strerror(gif->error));
+            failed = 1;
+        }
+        gd_render_frame(gif, out[i]);
+        gd_close_gif(gif);
+    }
+    if (memcmp(out[0], out[1], n * 3)) {
+        fprintf(stderr, "threads: frame differs\n");
+        failed = 1;
+    }
+    free(pix);
+    free(out[0]);
+    free(out[1]);
+    free(w.data);
+}
+#endif
+
+int
+main(void)
+{
+    static const int seeks[] = {3, 0, 2, 1, 0, 3, 3, 1};
+    Writer w = {NULL, 0, 0};
+    uint8_t ref[NFRAMES * FRAME_SIZE];
+    gd_Cache *cache;
+    gd_GIF *gif, *other;
+    int n, i;
+
+    make_gif(&w);
+    /* Decoding alone, from a fresh handle. */
+    gif = gd_open_gif_memory(w.data, w.len);
+    for (n = 0; n < NFRAMES && gd_get_frame(gif) == 1; n++)
+        gd_render_frame_fmt(gif, &ref[n * FRAME_SIZE], W * 4, GD_RGBA);
+    gd_close_gif(gif);
+    if (n != NFRAMES) {
+        fprintf(stderr, "test GIF doesn't decode\n");
+        return 1;
+    }
+    gif = gd_open_gif_memory(w.data, w.len);
+    play(gif, 3, ref, "rewind");
+    gd_close_gif(gif);
+    /* A looping handle fills the cache, another one reads from it. */
+    cache = gd_open_cache((size_t) 1 << 20, NULL);
+    gif = gd_open_gif_memory(w.data, w.len);
+    other = gd_open_gif_memory(w.data, w.len);
+    if (gd_set_cache(gif, cache, 1) || gd_set_cache(other, cache, 1)) {
+        fprintf(stderr, "gd_set_cache() failed\n");
+        return 1;
+    }
+    play(gif, 3, ref, "looping");
+    play(other, 2, ref, "cached");
+    for (i = 0; i < (int) (sizeof(seeks) / sizeof(seeks[0])); i++) {
+        if (gd_seek_frame(other, seeks[i]) != 1) {
+            fprintf(stderr, "cached: seeking frame %d failed\n", seeks[i]);
+            failed = 1;
+            continue;
+        }
+        check(other, NULL, ref, "cached seek");
+    }
+    gd_close_gif(gif);
+    gd_close_gif(other);
+    gd_close_cache(cache);
+    /* RGB and compact canvases, from an opaque canvas, then a blank one. */
+    for (i = 0; i < 2; i++) {
+        check_blits(0, i);
+        check_blits(1, i);
+    }
+    free(w.data);
+    if (load_anim()) {
+        fprintf(stderr, "blit GIF doesn't decode\n");
+        return 1;
+    }
+    check_push();
+    check_seek();
+    check_trim();
+    check_limits();
+    check_sources();
+#ifdef GD_THREADS
+    check_threads();
+#endif
+    if (!failed)
+        printf("ok\n");
+    return failed;
+}